@@ -106,7 +106,7 @@ _poll(struct connection_server * server) {
 		timeout = 0;
 
 		if (buffer == NULL) {
-			buffer = malloc(DEFAULT_BUFFER_SIZE);
+			buffer = skynet_malloc(DEFAULT_BUFFER_SIZE);
 		}
 
 		int size = read(c->fd, buffer, DEFAULT_BUFFER_SIZE);
@@ -115,7 +115,7 @@ _poll(struct connection_server * server) {
 		}
 		if (size == 0) {
 			connection_del(server->pool, c->fd);
-			free(buffer);
+			skynet_free(buffer);
 			buffer = NULL;
 			// todo: support user defined type
 			skynet_send(server->ctx, 0, c->address, PTYPE_CLIENT | PTYPE_TAG_DONTCOPY, 0, NULL, 0);
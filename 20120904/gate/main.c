@@ -138,7 +138,7 @@ _forward(struct skynet_context * ctx,struct gate *g, int uid, void * data, size_
 	if (agent->agent) {
 		skynet_send(ctx, agent->client, agent->agent, g->client_tag, 0 , data, len);
 	} else if (g->watchdog) {
-		char * tmp = malloc(len + 32);
+		char * tmp = skynet_malloc(len + 32);
 		int n = snprintf(tmp,len+32,"%d data ",uid);
 		memcpy(tmp+n,data,len);
 		skynet_send(ctx, 0, g->watchdog, PTYPE_TEXT | PTYPE_TAG_DONTCOPY, 0, tmp, len + n);
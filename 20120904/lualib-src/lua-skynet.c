@@ -6,6 +6,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdio.h>
+
+#define SHARED_BUFFER "skynet.buffer"
+#define PROFILE "skynet.profile"
+
+#define PROFILE_DEPTH 64
+#define PROFILE_HASH 1024
+#define PROFILE_FRAME 128
+#define DEFAULT_PROFILE_COUNT 1000
+
+// 持有共享 buffer 的一个引用， gc 时释放
+struct lua_buffer {
+	void * data;
+	size_t sz;
+};
 
 static int
 _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
@@ -93,6 +108,46 @@ _genid(lua_State *L) {
 	return 1;
 }
 
+/*
+	string message
+	return userdata shared_buffer
+ */
+static int
+_buffer(lua_State *L) {
+	size_t sz = 0;
+	const char * str = luaL_checklstring(L,1,&sz);
+	struct lua_buffer * b = lua_newuserdata(L, sizeof(*b));
+	b->data = skynet_buffer_new(sz);
+	b->sz = sz;
+	memcpy(b->data, str, sz);
+	luaL_setmetatable(L, SHARED_BUFFER);
+	return 1;
+}
+
+static int
+_buffer_gc(lua_State *L) {
+	struct lua_buffer * b = luaL_checkudata(L,1,SHARED_BUFFER);
+	skynet_buffer_release(b->data);
+	b->data = NULL;
+	return 0;
+}
+
+static int
+_buffer_len(lua_State *L) {
+	struct lua_buffer * b = luaL_checkudata(L,1,SHARED_BUFFER);
+	lua_pushinteger(L, b->sz);
+	return 1;
+}
+
+// 发送共享 buffer 会转移一个引用，所以先 grab ，userdata 自己的引用仍由 gc 释放
+static void *
+_sharedbuffer(lua_State *L, int index, size_t *sz) {
+	struct lua_buffer * b = luaL_checkudata(L,index,SHARED_BUFFER);
+	skynet_buffer_grab(b->data);
+	*sz = b->sz;
+	return b->data;
+}
+
 // copy from _send
 
 static int
@@ -123,6 +178,12 @@ _sendname(lua_State *L, struct skynet_context * context, const char * dest) {
 		session = skynet_sendname(context, dest, type | PTYPE_TAG_DONTCOPY, session, msg, size);
 		break;
 	}
+	case LUA_TUSERDATA: {
+		size_t size = 0;
+		void * msg = _sharedbuffer(L, 4, &size);
+		session = skynet_sendname(context, dest, type | PTYPE_TAG_SHARED, session, msg, size);
+		break;
+	}
 	default:
 		luaL_error(L, "skynet.send invalid param %s", lua_type(L,4));
 	}
@@ -138,6 +199,7 @@ _sendname(lua_State *L, struct skynet_context * context, const char * dest) {
 	string message
 	 lightuserdata message_ptr
 	 integer len
+	 userdata shared_buffer
  */
 static int
 _send(lua_State *L) {
@@ -189,6 +251,12 @@ _send(lua_State *L) {
 		session = skynet_send(context, 0, dest, type | PTYPE_TAG_DONTCOPY, session, msg, size);
 		break;
 	}
+	case LUA_TUSERDATA: {
+		size_t size = 0;
+		void * msg = _sharedbuffer(L, 4, &size);
+		session = skynet_send(context, 0, dest, type | PTYPE_TAG_SHARED, session, msg, size);
+		break;
+	}
 	default:
 		luaL_error(L, "skynet.send invalid param %s", lua_type(L,4));
 	}
@@ -221,12 +289,219 @@ _redirect(lua_State *L) {
 		session = skynet_send(context, source, dest, type | PTYPE_TAG_DONTCOPY, session, msg, size);
 		break;
 	}
+	case LUA_TUSERDATA: {
+		size_t size = 0;
+		void * msg = _sharedbuffer(L, 5, &size);
+		session = skynet_send(context, source, dest, type | PTYPE_TAG_SHARED, session, msg, size);
+		break;
+	}
 	default:
 		luaL_error(L, "skynet.redirect invalid param %s", lua_type(L,5));
 	}
 	return 0;
 }
 
+/*
+	unsigned address
+	只能在消息回调中调用，当前消息不复制地转发给 address
+ */
+static int
+_forward(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	uint32_t dest = luaL_checkunsigned(L,1);
+	if (skynet_forward(context, dest)) {
+		return luaL_error(L, "The message is already forwarded");
+	}
+	return 0;
+}
+
+/*
+ 采样分析器：用 count hook 每执行 count 条指令采一次调用栈，
+ 按 "root;...;leaf" 的折叠格式计数，可以直接交给 flamegraph 。
+ 每个 lua_State 一份，是存放在注册表中的 userdata ，服务退出时由 __gc 释放。
+ 调用栈节点用 malloc 分配，不计入 lua 内存。
+*/
+struct profile_node {
+	struct profile_node * next;
+	unsigned hash;
+	int count;
+	char stack[1];
+};
+
+struct profile {
+	int running;
+	int samples;
+	struct profile_node * hash[PROFILE_HASH];
+};
+
+static unsigned
+_profile_hash(const char * str) {
+	unsigned h = 0;
+	while (*str) {
+		h = h ^ ((h<<5) + (h>>2) + (unsigned char)*str);
+		++str;
+	}
+	return h;
+}
+
+// 折叠格式用 ';' 分隔栈帧，用最后一个空格分隔计数，所以帧名里不能有这两个字符
+static int
+_profile_frame(char * buffer, lua_Debug *ar) {
+	const char * name = ar->name ? ar->name : "?";
+	int n;
+	if (*ar->what == 'C') {
+		n = snprintf(buffer, PROFILE_FRAME, "%s@[C]", name);
+	} else if (*ar->what == 'm') {
+		n = snprintf(buffer, PROFILE_FRAME, "main@%s", ar->short_src);
+	} else {
+		n = snprintf(buffer, PROFILE_FRAME, "%s@%s:%d", name, ar->short_src, ar->linedefined);
+	}
+	if (n >= PROFILE_FRAME) {
+		n = PROFILE_FRAME - 1;
+	}
+	int i;
+	for (i=0;i<n;i++) {
+		if (buffer[i] == ';' || buffer[i] == ' ') {
+			buffer[i] = '_';
+		}
+	}
+	return n;
+}
+
+static void
+_profile_sample(struct profile *p, lua_State *L) {
+	lua_Debug ar[PROFILE_DEPTH];
+	int depth = 0;
+	while (depth < PROFILE_DEPTH && lua_getstack(L, depth, &ar[depth])) {
+		lua_getinfo(L, "Sn", &ar[depth]);
+		++depth;
+	}
+	if (depth == 0)
+		return;
+	char stack[PROFILE_DEPTH * PROFILE_FRAME];
+	int sz = 0;
+	int i;
+	for (i=depth-1;i>=0;i--) {
+		sz += _profile_frame(stack + sz, &ar[i]);
+		stack[sz++] = ';';
+	}
+	stack[sz-1] = '\0';
+
+	unsigned h = _profile_hash(stack);
+	struct profile_node ** slot = &p->hash[h & (PROFILE_HASH-1)];
+	struct profile_node * node = *slot;
+	while (node) {
+		if (node->hash == h && strcmp(node->stack, stack) == 0) {
+			++node->count;
+			++p->samples;
+			return;
+		}
+		node = node->next;
+	}
+	node = malloc(sizeof(*node) + sz);
+	node->hash = h;
+	node->count = 1;
+	memcpy(node->stack, stack, sz);
+	node->next = *slot;
+	*slot = node;
+	++p->samples;
+}
+
+static void
+_profile_hook(lua_State *L, lua_Debug *ar) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, _profile_hook);
+	struct profile * p = lua_touserdata(L, -1);
+	lua_pop(L,1);
+	if (p == NULL || !p->running) {
+		// 停止之后，继承了 hook 的协程在这里各自摘掉
+		lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+	_profile_sample(p, L);
+}
+
+static void
+_profile_clear(struct profile *p) {
+	int i;
+	for (i=0;i<PROFILE_HASH;i++) {
+		struct profile_node * node = p->hash[i];
+		while (node) {
+			struct profile_node * next = node->next;
+			free(node);
+			node = next;
+		}
+		p->hash[i] = NULL;
+	}
+	p->samples = 0;
+}
+
+/*
+	string "start"
+	 integer count (每执行多少条指令采样一次)
+	string "stop"
+	 return string folded_stacks, integer samples
+ */
+static int
+_profile_gc(lua_State *L) {
+	struct profile * p = luaL_checkudata(L, 1, PROFILE);
+	p->running = 0;
+	_profile_clear(p);
+	return 0;
+}
+
+static int
+_profile(lua_State *L) {
+	const char * cmd = luaL_checkstring(L,1);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, _profile_hook);
+	struct profile * p = lua_touserdata(L, -1);
+	lua_pop(L,1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	lua_State *gL = lua_tothread(L,-1);
+	lua_pop(L,1);
+
+	if (strcmp(cmd, "start") == 0) {
+		int count = luaL_optinteger(L, 2, DEFAULT_PROFILE_COUNT);
+		if (p == NULL) {
+			p = lua_newuserdata(L, sizeof(*p));
+			memset(p, 0, sizeof(*p));
+			luaL_setmetatable(L, PROFILE);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, _profile_hook);
+		}
+		p->running = 1;
+		// 新协程从主线程继承 hook ，当前协程要单独设置
+		lua_sethook(gL, _profile_hook, LUA_MASKCOUNT, count);
+		lua_sethook(L, _profile_hook, LUA_MASKCOUNT, count);
+		return 0;
+	}
+	if (strcmp(cmd, "stop") == 0) {
+		if (p == NULL) {
+			return 0;
+		}
+		p->running = 0;
+		lua_sethook(gL, NULL, 0, 0);
+		lua_sethook(L, NULL, 0, 0);
+
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		int i;
+		for (i=0;i<PROFILE_HASH;i++) {
+			struct profile_node * node = p->hash[i];
+			while (node) {
+				char tmp[16];
+				luaL_addstring(&b, node->stack);
+				sprintf(tmp, " %d\n", node->count);
+				luaL_addstring(&b, tmp);
+				node = node->next;
+			}
+		}
+		luaL_pushresult(&b);
+		lua_pushinteger(L, p->samples);
+		_profile_clear(p);
+		return 2;
+	}
+	return luaL_error(L, "Invalid profile command %s", cmd);
+}
+
 static int
 _error(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -239,6 +514,11 @@ _tostring(lua_State *L) {
 	if (lua_isnoneornil(L,1)) {
 		return 0;
 	}
+	if (lua_type(L,1) == LUA_TUSERDATA) {
+		struct lua_buffer * b = luaL_checkudata(L,1,SHARED_BUFFER);
+		lua_pushlstring(L,b->data,b->sz);
+		return 1;
+	}
 	char * msg = lua_touserdata(L,1);
 	int sz = luaL_checkinteger(L,2);
 	lua_pushlstring(L,msg,sz);
@@ -263,6 +543,18 @@ int remoteobj_init(lua_State *L);
 int
 luaopen_skynet_c(lua_State *L) {
 	luaL_checkversion(L);
+
+	luaL_newmetatable(L, SHARED_BUFFER);
+	lua_pushcfunction(L, _buffer_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, _buffer_len);
+	lua_setfield(L, -2, "__len");
+	lua_pop(L,1);
+
+	luaL_newmetatable(L, PROFILE);
+	lua_pushcfunction(L, _profile_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L,1);
 	
 	luaL_Reg pack[] = {
 		{ "pack", _luaseri_pack },
@@ -274,6 +566,9 @@ luaopen_skynet_c(lua_State *L) {
 		{ "send" , _send },
 		{ "genid", _genid },
 		{ "redirect", _redirect },
+		{ "forward", _forward },
+		{ "buffer", _buffer },
+		{ "profile", _profile },
 		{ "command" , _command },
 		{ "callback" , _callback },
 		{ "error", _error },
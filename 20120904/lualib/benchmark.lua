@@ -0,0 +1,71 @@
+local skynet = require "skynet"
+
+-- 压力测试的公共部分。
+-- 负载服务调用 benchmark.worker(f) ，收到开始请求后执行 f(...) ，返回自己用的微秒数和 f 的结果。
+-- 主服务用 benchmark.launch 启动负载服务并绑定 worker ，再用 benchmark.run 让它们同时开始并等待全部返回。
+-- 开始请求在 LAUNCH 返回（绑定已经生效）之后才发出，负载不会先在别的 worker 上跑起来。
+
+local benchmark = {}
+
+function benchmark.worker(f)
+	skynet.start(function()
+		skynet.dispatch("lua", function(session, source, ...)
+			local start = skynet.now_us()
+			local result = f(...)
+			skynet.ret(skynet.pack(skynet.now_us() - start, result))
+		end)
+	end)
+end
+
+-- 参与测试的线程数 1, 2, 4 ... ，不超过 config 里的 thread 减去 reserve ，最多 64
+function benchmark.threads(reserve)
+	local limit = math.min((tonumber(skynet.getenv "thread") or 8) - (reserve or 0), 64)
+	local t = {}
+	local n = 1
+	while n <= limit do
+		table.insert(t, n)
+		n = n * 2
+	end
+	return t
+end
+
+-- affinity 的格式同 LAUNCH 命令的 @affinity ，可以是 worker 编号， nil 表示不绑定
+function benchmark.launch(affinity, script, ...)
+	if affinity then
+		return skynet.launch("@" .. affinity, "snlua", script, ...)
+	else
+		return skynet.launch("snlua", script, ...)
+	end
+end
+
+function benchmark.kill(handles)
+	for _, handle in ipairs(handles) do
+		skynet.kill(string.format(":%x", handle))
+	end
+end
+
+-- 同时向每个 handles[i] 发出开始请求，参数是 args(i) 的返回值。
+-- 返回从开始到最后一个服务返回的微秒数，以及每个服务自己的用时和结果。
+function benchmark.run(handles, args)
+	local n = #handles
+	local finished = 0
+	local waiting = coroutine.running()
+	local elapsed = {}
+	local result = {}
+	local start = skynet.now_us()
+	for i = 1, n do
+		skynet.fork(function()
+			elapsed[i], result[i] = skynet.call(handles[i], "lua", args(i))
+			finished = finished + 1
+			if finished == n then
+				skynet.wakeup(waiting)
+			end
+		end)
+	end
+	while finished < n do
+		skynet.sleep(100)
+	end
+	return skynet.now_us() - start, elapsed, result
+end
+
+return benchmark
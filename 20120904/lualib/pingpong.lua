@@ -0,0 +1,57 @@
+local skynet = require "skynet"
+local benchmark = require "benchmark"
+
+-- ping-pong 测试的公共部分：若干对服务用 skynet.call 来回传一块数据。
+-- 测试脚本以 "pong" 或 "ping" 模式启动时交给 pingpong.service 处理，主服务用 pingpong.run 启动并计时。
+
+local pingpong = {}
+
+-- mode 是 "pong" 或 "ping" 时启动对应的服务并返回 true
+function pingpong.service(mode)
+	if mode == "pong" then
+		skynet.start(function()
+			skynet.dispatch("text", function(session, source, msg)
+				skynet.ret(msg)
+			end)
+		end)
+		return true
+	end
+	if mode == "ping" then
+		benchmark.worker(function(pong, rounds, size)
+			local payload = string.rep("x", size)
+			local sum = 0
+			for i = 1, rounds do
+				local ret = skynet.call(pong, "text", payload)
+				-- 读一遍回来的数据，让它真正经过内存
+				if size > 0 then
+					sum = sum + ret:byte(i % size + 1)
+				end
+			end
+			return sum
+		end)
+		return true
+	end
+end
+
+-- 启动 npair 对服务，每对往返 rounds 次，每次带 size 字节，全部完成后返回用的微秒数。
+-- placement(i) 返回第 i 对中 pong 和 ping 的绑定（同 benchmark.launch ），为 nil 时不绑定。
+function pingpong.run(script, npair, rounds, size, placement)
+	local pong = {}
+	local ping = {}
+	for i = 1, npair do
+		local a, b
+		if placement then
+			a, b = placement(i)
+		end
+		pong[i] = benchmark.launch(a, script, "pong")
+		ping[i] = benchmark.launch(b, script, "ping")
+	end
+	local elapsed = benchmark.run(ping, function(i)
+		return pong[i], rounds, size
+	end)
+	benchmark.kill(ping)
+	benchmark.kill(pong)
+	return elapsed
+end
+
+return pingpong
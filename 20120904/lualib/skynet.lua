@@ -24,6 +24,9 @@ local session_coroutine_address = {}
 local wakeup_session = {}
 local sleep_session = {}
 
+-- 正在第一次运行的消息处理协程，只有它能转发当前消息
+local forward_coroutine
+
 -- suspend is function
 local suspend
 
@@ -33,7 +36,12 @@ local function dispatch_wakeup()
 		wakeup_session[co] = nil
 		local session = sleep_session[co]
 		if session then
-			session_id_coroutine[session] = "BREAK"
+			if c.command("CANCEL", tostring(session)) then
+				session_id_coroutine[session] = nil
+			else
+				-- 定时器已经到期，响应消息还在队列里
+				session_id_coroutine[session] = "BREAK"
+			end
 			return suspend(co, coroutine.resume(co, true))
 		end
 	end
@@ -94,6 +102,16 @@ function skynet.sleep(ti)
 	end
 end
 
+function skynet.sleep_ms(ti)
+	local session = c.command("TIMEOUT_MS",tostring(ti))
+	assert(session)
+	local ret = coroutine.yield("SLEEP", tonumber(session))
+	sleep_session[coroutine.running()] = nil
+	if ret == true then
+		return "BREAK"
+	end
+end
+
 function skynet.yield()
 	local session = c.command("TIMEOUT","0")
 	assert(session)
@@ -133,6 +151,11 @@ function skynet.now()
 	return tonumber(c.command("NOW"))
 end
 
+-- 定时器启动以来的微秒数，用来测量比嘀嗒更短的时间
+function skynet.now_us()
+	return tonumber(c.command("NOW_US"))
+end
+
 function skynet.starttime()
 	return tonumber(c.command("STARTTIME"))
 end
@@ -141,6 +164,173 @@ function skynet.exit()
 	c.command("EXIT")
 end
 
+-- 返回服务的消息队列长度， addr 为 nil 时查询自己
+function skynet.mqlen(addr)
+	if addr == nil then
+		return tonumber(c.command("MQLEN"))
+	elseif type(addr) == "number" then
+		addr = string.format(":%x", addr)
+	end
+	return tonumber(c.command("MQLEN", addr))
+end
+
+-- 设置自己队列的高水位，越过时会收到 overload 消息， 0 表示不限制
+function skynet.mqlimit(n)
+	c.command("MQLIMIT", tostring(n))
+end
+
+-- 越过高水位后对 typename 类消息的处理： "accept" "drop" 或 "reject"
+function skynet.mqpolicy(typename, policy)
+	c.command("MQPOLICY", proto[typename].id .. " " .. policy)
+end
+
+-- 返回服务的统计： message bytes_in bytes_out cpu(微秒) mqlen_max drop stall ， addr 为 nil 时查询自己
+function skynet.stat(addr)
+	local r
+	if addr == nil then
+		r = c.command("STAT")
+	elseif type(addr) == "number" then
+		r = c.command("STAT", string.format(":%x", addr))
+	else
+		r = c.command("STAT", addr)
+	end
+	if r then
+		local message, bytes_in, bytes_out, cpu, mqlen_max, drop, stall = string.match(r, "(%d+) (%d+) (%d+) (%d+) (%d+) (%d+) (%d+)")
+		return {
+			message = tonumber(message),
+			bytes_in = tonumber(bytes_in),
+			bytes_out = tonumber(bytes_out),
+			cpu = tonumber(cpu),
+			mqlen_max = tonumber(mqlen_max),
+			drop = tonumber(drop),
+			stall = tonumber(stall),
+		}
+	end
+end
+
+-- 把所有服务和 worker 的统计追加到文件中
+function skynet.statdump(filename)
+	c.command("STATDUMP", filename)
+end
+
+-- 把服务绑定到一组 worker ： spec 是 "0,1" 这样的编号列表， "node:N" ， "exclusive" 或 "any" ， addr 为 nil 时作用于自己
+-- 启动时绑定可以用 skynet.launch("@exclusive", "gate", ...)
+function skynet.affinity(addr, spec)
+	if addr == nil then
+		c.command("AFFINITY", spec)
+	else
+		if type(addr) == "number" then
+			addr = string.format(":%x", addr)
+		end
+		c.command("AFFINITY", addr .. " " .. spec)
+	end
+end
+
+-- 开始统计所有 worker 线程的 cache miss ，内核不允许使用性能计数器时返回 false
+function skynet.perf_start()
+	return tonumber(c.command("PERF", "start")) > 0
+end
+
+-- 停止统计，返回期间的 cache miss 总数
+function skynet.perf_stop()
+	return tonumber(c.command("PERF", "stop"))
+end
+
+-- 设置直接交接的连续次数上限， 0 表示关闭，对整个进程生效
+function skynet.handoff(limit)
+	c.command("HANDOFF", tostring(limit))
+end
+
+-- NUMA 节点数，可以用 "node:N" 作为 affinity 把服务绑定到某个节点
+function skynet.nodes()
+	return tonumber(c.command("NODE"))
+end
+
+-- 设置服务的调度优先级： "high" "normal" 或 "low" ， addr 为 nil 时作用于自己
+function skynet.priority(addr, level)
+	if addr == nil then
+		c.command("PRIORITY", level)
+	else
+		if type(addr) == "number" then
+			addr = string.format(":%x", addr)
+		end
+		c.command("PRIORITY", addr .. " " .. level)
+	end
+end
+
+-- 为当前消息开始一个追踪并返回追踪 id ，这次处理中发出的消息都会带上它
+-- 传入 id 时加入已有的追踪， 0 表示停止追踪
+function skynet.trace(id)
+	return tonumber(c.command("TRACE", id and tostring(id)))
+end
+
+-- 把追踪记录的时间线和排队延迟直方图追加到文件中
+function skynet.tracedump(filename)
+	c.command("TRACEDUMP", filename)
+end
+
+-- 开始采样分析，每执行 count 条指令采样一次， addr 为 nil 时作用于自己
+function skynet.profile_start(addr, count)
+	if addr == nil then
+		c.command("PROFILE", "start " .. (count or ""))
+	else
+		if type(addr) == "number" then
+			addr = string.format(":%x", addr)
+		end
+		c.command("PROFILE", addr .. " start " .. (count or ""))
+	end
+end
+
+-- 停止采样分析，把折叠格式的调用栈写入 filename ，缺省为 profile-<handle>.folded
+function skynet.profile_stop(addr, filename)
+	if addr == nil then
+		c.command("PROFILE", "stop " .. (filename or ""))
+	else
+		if type(addr) == "number" then
+			addr = string.format(":%x", addr)
+		end
+		c.command("PROFILE", addr .. " stop " .. (filename or ""))
+	end
+end
+
+local function debug_profile(cmd, arg)
+	if cmd == "start" then
+		c.profile("start", tonumber(arg))
+	elseif cmd == "stop" then
+		local folded, samples = c.profile("stop")
+		if folded == nil then
+			return
+		end
+		if arg == nil or arg == "" then
+			arg = string.format("profile-%08x.folded", skynet.self())
+		end
+		local f = io.open(arg, "w")
+		if f == nil then
+			c.error("Can't open profile file " .. arg)
+			return
+		end
+		f:write(folded)
+		f:close()
+		c.error(string.format("Profile %d samples to %s", samples, arg))
+	end
+end
+
+-- 返回服务的 lua 内存、尚未释放的消息数据、队列中待处理的消息数据三个字节数， addr 为 nil 时查询自己
+function skynet.memory(addr)
+	local r
+	if addr == nil then
+		r = c.command("MEM")
+	elseif type(addr) == "number" then
+		r = c.command("MEM", string.format(":%x", addr))
+	else
+		r = c.command("MEM", addr)
+	end
+	if r then
+		local heap, message, queue = string.match(r, "(%d+) (%d+) (%d+)")
+		return tonumber(heap), tonumber(message), tonumber(queue)
+	end
+end
+
 function skynet.kill(name)
 	c.command("KILL",name)
 end
@@ -164,6 +354,21 @@ skynet.redirect = function(dest,source,typename,...)
 	return c.redirect(dest, source, proto[typename].id, ...)
 end
 
+-- 共享 buffer ：用 skynet.buffer(str) 创建，作为消息发给多个服务时不复制
+skynet.buffer = assert(c.buffer)
+-- 在消息处理函数中、第一次让出之前调用，把当前消息原样转发给 addr ，不复制。
+-- 让出之后（比如 skynet.call 返回后）回调里已经是别的消息了，这时调用会抛出错误。
+function skynet.forward(addr)
+	if forward_coroutine == nil or coroutine.running() ~= forward_coroutine then
+		error "skynet.forward must be called before the dispatch function yields"
+	end
+	c.forward(addr)
+end
+
+function skynet.sendbuffer(addr, typename, buffer)
+	return c.send(addr, proto[typename].id, 0, buffer)
+end
+
 skynet.pack = assert(c.pack)
 skynet.unpack = assert(c.unpack)
 skynet.tostring = assert(c.tostring)
@@ -171,6 +376,9 @@ skynet.tostring = assert(c.tostring)
 function skynet.call(addr, typename, ...)
 	local p = proto[typename]
 	local session = c.send(addr, p.id , nil , p.pack(...))
+	if session < 0 then
+		error(string.format("call %s failed : service is gone or overloaded", tostring(addr)))
+	end
 	return p.unpack(coroutine.yield("CALL", session))
 end
 
@@ -196,6 +404,10 @@ function skynet.dispatch(typename, func)
 	local p = assert(proto[typename],tostring(typename))
 	assert(p.dispatch == nil, tostring(typename))
 	p.dispatch = func
+	if typename == "overload" then
+		-- 过载通知默认不发，处理它的服务要先声明
+		c.command("MQNOTIFY")
+	end
 end
 
 local function unknown_response(session, address, msg, sz)
@@ -228,7 +440,12 @@ local function dispatch_message(prototype, msg, sz, session, source, ...)
 			local co = coroutine.create(f)
 			session_coroutine_id[co] = session
 			session_coroutine_address[co] = source
-			suspend(co, coroutine.resume(co, session,source, p.unpack(msg,sz, ...)))
+			forward_coroutine = co
+			local result, command, param, size = coroutine.resume(co, session,source, p.unpack(msg,sz, ...))
+			forward_coroutine = nil
+			suspend(co, result, command, param, size)
+		elseif p == proto.overload then
+			-- 没有注册处理函数时忽略过载通知
 		else
 			print("Unknown request :" , p.unpack(msg,sz))
 			error(string.format("Can't dispatch type %s : ", p.name))
@@ -393,6 +610,28 @@ do
 		name = "response",
 		id = 1,
 	}
+
+	-- 调试命令，由 PROFILE 等命令发给服务自己处理
+	REG {
+		name = "debug",
+		id = 7,
+		unpack = c.tostring,
+		dispatch = function (session, source, msg)
+			local cmd, sub, arg = string.match(msg, "(%S+)%s*(%S*)%s*(%S*)")
+			if cmd == "PROFILE" then
+				debug_profile(sub, arg)
+			end
+		end,
+	}
+
+	-- 队列过载通知， source 是过载的服务，内容是队列长度
+	REG {
+		name = "overload",
+		id = 6,
+		unpack = function (msg, sz)
+			return tonumber(c.tostring(msg,sz))
+		end,
+	}
 end
 
 function skynet.start(f)
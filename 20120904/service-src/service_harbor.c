@@ -48,6 +48,7 @@ struct remote_message_header {
 	uint32_t source;
 	uint32_t destination;	// (destination & HANDLE_MASK) | ((uint32_t)type << HANDLE_REMOTE_SHIFT)
 	uint32_t session;
+	uint32_t trace;
 };
 
 struct harbor {
@@ -84,7 +85,7 @@ _push_queue(struct msg_queue * queue, const void * buffer, size_t sz, struct rem
 		queue->size *= 2;
 		slot = &queue->data[queue->tail];
 	}
-	slot->buffer = malloc(sz + sizeof(*header));
+	slot->buffer = skynet_malloc(sz + sizeof(*header));
 	memcpy(slot->buffer, buffer, sz);
 	memcpy(slot->buffer + sz, header, sizeof(*header));
 	slot->size = sz + sizeof(*header);
@@ -126,7 +127,7 @@ _release_queue(struct msg_queue *queue) {
 		return;
 	struct msg * m = _pop_queue(queue);
 	while (m) {
-		free(m->buffer);
+		skynet_free(m->buffer);
 		m = _pop_queue(queue);
 	}
 	free(queue->data);
@@ -293,6 +294,7 @@ _header_to_message(const struct remote_message_header * header, uint32_t * messa
 	message[0] = htonl(header->source);
 	message[1] = htonl(header->destination);
 	message[2] = htonl(header->session);
+	message[3] = htonl(header->trace);
 }
 
 /*
@@ -303,6 +305,7 @@ _message_to_header(const uint32_t *message, struct remote_message_header *header
 	header->source = ntohl(message[0]);
 	header->destination = ntohl(message[1]);
 	header->session = ntohl(message[2]);
+	header->trace = ntohl(message[3]);
 }
 
 /*
@@ -359,7 +362,7 @@ _send_remote(int fd, const char * buffer, size_t sz, struct remote_message_heade
 	part[1].iov_base = (char *)buffer;
 	part[1].iov_len = sz;
 
-	uint32_t header[3];
+	uint32_t header[4];
 	_header_to_message(cookie, header);
 
 	part[2].iov_base = header;
@@ -426,6 +429,7 @@ _dispatch_queue(struct harbor *h, struct skynet_context * context, struct msg_qu
 		cookie->destination |= (handle & HANDLE_MASK);	// (destination & HANDLE_MASK) | ((uint32_t)type << HANDLE_REMOTE_SHIFT)
 		_header_to_message(cookie, (uint32_t *)cookie);
 		int err = _send_package(fd, m->buffer, m->size);
+		skynet_free(m->buffer);
 		if (err) {
 			close(fd);
 			h->remote_fd[harbor_id] = _connect_to(context, h->remote_addr[harbor_id]);
@@ -502,6 +506,7 @@ _remote_send_handle(struct harbor *h, struct skynet_context * context, uint32_t
 		cookie.source = source;
 		cookie.destination = (destination & HANDLE_MASK) | ((uint32_t)type << HANDLE_REMOTE_SHIFT);
 		cookie.session = (uint32_t)session;
+		cookie.trace = skynet_trace_current();
 		int err = _send_remote(fd, msg,sz,&cookie);
 		if (err) {
 			close(fd);
@@ -545,6 +550,7 @@ _remote_send_name(struct harbor *h, struct skynet_context * context, uint32_t so
 		header.source = source;
 		header.destination = type << HANDLE_REMOTE_SHIFT;
 		header.session = (uint32_t)session;
+		header.trace = skynet_trace_current();
 		_push_queue(node->queue, msg, sz, &header);
 		// 0 for request
 		_remote_register_name(h, context, name, 0);
@@ -566,24 +572,25 @@ _mainloop(struct skynet_context * context, void * ud, int type, int session, uin
 	switch (type) {
 	case PTYPE_HARBOR: {
 		// remote message in
-		const char * cookie = msg;
-		cookie += sz - 12;
 		struct remote_message_header header;
+		const char * cookie = msg;
+		sz -= sizeof(header);
+		cookie += sz;
 		_message_to_header((const uint32_t *)cookie, &header);
 		if (header.source == 0) {
 			if (header.destination < REMOTE_MAX) {
 				// 1 byte harbor id (0~255)
 				// update remote harbor address
-				char ip [sz - 11];
-				memcpy(ip, msg, sz-12);
-				ip[sz-11] = '\0';
+				char ip [sz + 1];
+				memcpy(ip, msg, sz);
+				ip[sz] = '\0';
 				_update_remote_address(context, h, header.destination, ip);
 			} else {
 				// update global name
-				if (sz - 12 > GLOBALNAME_LENGTH) {
-					char name[sz-11];
-					memcpy(name, msg, sz-12);
-					name[sz-11] = '\0';
+				if (sz > GLOBALNAME_LENGTH) {
+					char name[sz+1];
+					memcpy(name, msg, sz);
+					name[sz] = '\0';
 					skynet_error(context, "Global name is too long %s", name);
 				}
 				_update_remote_name(h, context, msg, header.destination);
@@ -592,7 +599,10 @@ _mainloop(struct skynet_context * context, void * ud, int type, int session, uin
 			uint32_t destination = header.destination;
 			int type = (destination >> HANDLE_REMOTE_SHIFT) | PTYPE_TAG_DONTCOPY;
 			destination = (destination & HANDLE_MASK) | ((uint32_t)h->id << HANDLE_REMOTE_SHIFT);
-			skynet_send(context, header.source, destination, type, (int)header.session, (void *)msg, sz-12);
+			// 让转发出去的消息带上对端的追踪 id
+			skynet_trace_set(header.trace);
+			skynet_send(context, header.source, destination, type, (int)header.session, (void *)msg, sz);
+			skynet_trace_set(0);
 			return 1;
 		}
 		return 0;
@@ -616,7 +626,7 @@ _mainloop(struct skynet_context * context, void * ud, int type, int session, uin
 				return 0;
 			}
 		}
-		free((void *)rmsg->message);
+		skynet_free((void *)rmsg->message);
 		return 0;
 	}
 	}
@@ -8,9 +8,114 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-lua_State *
+struct snlua {
+	lua_State * L;
+	struct skynet_context * ctx;	// init 之后才有
+	size_t mem;
+	size_t mem_soft;	// 0 表示不限制
+	size_t mem_hard;
+	int mem_warning;	// 超过软上限时只报告一次，回落之后才再次报告
+	int mem_refused;	// 拒绝分配时只报告一次，之后有增长的分配成功才再次报告
+	int mem_kill;		// 超过硬上限时除了拒绝分配，还退出服务
+	int killed;
+	lua_State * active;	// 正在运行的协程， NULL 表示主线程，由 lock 保护
+	int lock;	// 监视线程读 active 并设置钩子期间，协程不能切换（也就不会被回收）
+	lua_Hook hook;	// 卡住时替换掉的钩子（比如 profiler ），报告后恢复
+	int hook_mask;
+	int hook_count;
+};
+
+#define LOCK(l) while (__sync_lock_test_and_set(&(l)->lock,1)) {}
+#define UNLOCK(l) __sync_lock_release(&(l)->lock);
+
+static size_t
+_limit(const char * key) {
+	const char * v = skynet_command(NULL, "GETENV", key);
+	if (v == NULL)
+		return 0;
+	return (size_t)strtol(v, NULL, 10) * 1024 * 1024;
+}
+
+static void *
+_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct snlua * l = ud;
+	// ptr 为 NULL 时 osize 是对象的类型而不是大小
+	size_t old = ptr ? osize : 0;
+	if (nsize == 0) {
+		free(ptr);
+		l->mem -= old;
+		if (l->ctx) {
+			skynet_memory_report(l->ctx, l->mem);
+		}
+		return NULL;
+	}
+	size_t mem = l->mem - old + nsize;
+	if (nsize > old) {
+		if (l->mem_hard && mem > l->mem_hard) {
+			if (l->ctx) {
+				if (!l->mem_refused) {
+					l->mem_refused = 1;
+					skynet_error(l->ctx, "lua memory %u bytes exceeds hard limit %u bytes", (unsigned)mem, (unsigned)l->mem_hard);
+				}
+				if (l->mem_kill && !l->killed) {
+					l->killed = 1;
+					skynet_command(l->ctx, "EXIT", NULL);
+				}
+			}
+			return NULL;
+		}
+		if (l->mem_soft && mem > l->mem_soft && !l->mem_warning) {
+			l->mem_warning = 1;
+			if (l->ctx) {
+				skynet_error(l->ctx, "lua memory %u bytes exceeds soft limit %u bytes", (unsigned)mem, (unsigned)l->mem_soft);
+			}
+		}
+	} else if (l->mem_warning && mem <= l->mem_soft) {
+		l->mem_warning = 0;
+	}
+	void * ret = realloc(ptr, nsize);
+	if (ret == NULL)
+		return NULL;
+	if (nsize > old) {
+		l->mem_refused = 0;
+	}
+	l->mem = mem;
+	if (l->ctx) {
+		skynet_memory_report(l->ctx, mem);
+	}
+	return ret;
+}
+
+static int
+_panic(lua_State *L) {
+	fprintf(stderr, "snlua : unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;
+}
+
+struct snlua *
 snlua_create(void) {
-	return luaL_newstate();
+	struct snlua * l = malloc(sizeof(*l));
+	l->ctx = NULL;
+	l->mem = 0;
+	l->mem_soft = _limit("memory_soft");
+	l->mem_hard = _limit("memory_hard");
+	l->mem_warning = 0;
+	l->mem_refused = 0;
+	const char * policy = skynet_command(NULL, "GETENV", "memory_policy");
+	l->mem_kill = policy && strcmp(policy, "kill") == 0;
+	l->killed = 0;
+	l->active = NULL;
+	l->lock = 0;
+	l->hook = NULL;
+	l->hook_mask = 0;
+	l->hook_count = 0;
+	l->L = lua_newstate(_alloc, l);
+	if (l->L == NULL) {
+		free(l);
+		return NULL;
+	}
+	lua_atpanic(l->L, _panic);
+	return l;
 }
 
 static int
@@ -88,12 +193,83 @@ traceback (lua_State *L) {
 	return 1;
 }
 
+/*
+ 包装 coroutine.resume ，记下正在运行的协程。
+ 调试钩子是按协程设置的，回调卡住时钩子要设在真正在跑的那个协程上。
+ 协程运行期间在调用者的栈上，不会被回收；切换 active 时加锁，监视线程拿到的 active 一定还活着。
+*/
+static int
+_resume(lua_State *L) {
+	struct snlua * l = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTHREAD);
+	lua_State * prev = l->active;
+	LOCK(l)
+	l->active = lua_tothread(L, 1);
+	UNLOCK(l)
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	LOCK(l)
+	l->active = prev;
+	UNLOCK(l)
+	return lua_gettop(L);
+}
+
+static void
+_hook_resume(struct snlua *l) {
+	lua_State *L = l->L;
+	lua_getglobal(L, "coroutine");
+	lua_pushlightuserdata(L, l);
+	lua_getfield(L, -2, "resume");
+	lua_pushcclosure(L, _resume, 2);
+	lua_setfield(L, -2, "resume");
+	lua_pop(L, 1);
+}
+
+static void
+_signal_hook(lua_State *L, lua_Debug *ar) {
+	lua_getfield(L, LUA_REGISTRYINDEX, "snlua");
+	struct snlua * l = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	LOCK(l)
+	lua_sethook(L, l->hook, l->hook_mask, l->hook_count);
+	UNLOCK(l)
+	luaL_traceback(L, L, "stalled", 1);
+	skynet_error(l->ctx, "%s", lua_tostring(L, -1));
+	lua_pop(L, 1);
+}
+
+/*
+ 由监视线程调用。 lua_sethook 可以在其他线程中安全地调用，
+ 钩子在卡住的协程执行下一条指令时触发，打印调用栈后恢复原来的钩子。
+*/
+void
+snlua_signal(struct snlua *l, int signal) {
+	LOCK(l)
+	lua_State * L = l->active ? l->active : l->L;
+	lua_Hook hook = lua_gethook(L);
+	// 上一次的报告还没打印时不要把它自己当作原来的钩子保存
+	if (hook != _signal_hook) {
+		l->hook = hook;
+		l->hook_mask = lua_gethookmask(L);
+		l->hook_count = lua_gethookcount(L);
+		lua_sethook(L, _signal_hook, LUA_MASKCOUNT, 1);
+	}
+	UNLOCK(l)
+}
+
 int
-snlua_init(lua_State *L, struct skynet_context *ctx, const char * args) {
+snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
+	lua_State *L = l->L;
+	l->ctx = ctx;
+	skynet_memory_report(ctx, l->mem);
 	lua_gc(L, LUA_GCSTOP, 0);
 	luaL_openlibs(L);
 	lua_pushlightuserdata(L, ctx);
 	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_context");
+	lua_pushlightuserdata(L, l);
+	lua_setfield(L, LUA_REGISTRYINDEX, "snlua");
+	_hook_resume(l);
 	lua_gc(L, LUA_GCRESTART, 0);
 
 	char tmp[strlen(args)+1];
@@ -145,6 +321,9 @@ snlua_init(lua_State *L, struct skynet_context *ctx, const char * args) {
 }
 
 void
-snlua_release(lua_State *L) {
-	lua_close(L);
+snlua_release(struct snlua *l) {
+	// 服务已经销毁，关闭虚拟机时不再报告内存
+	l->ctx = NULL;
+	lua_close(l->L);
+	free(l);
 }
@@ -129,10 +129,13 @@ _connect_to(const char *ipaddress) {
 	return fd;
 }
 
+// 和 harbor 的 remote_message_header 一致：source destination session trace
+#define HEADER_SIZE 16
+
 static int
 _send_to(int fd, const void * buf, size_t sz, uint32_t handle) {
-	char buffer[2 + sz + 12];
-	uint16_t header = htons(sz+12);
+	char buffer[2 + sz + HEADER_SIZE];
+	uint16_t header = htons(sz+HEADER_SIZE);
 	memcpy(buffer, &header, 2);
 	memcpy(buffer+2, buf, sz);
 	uint32_t u32 = 0;
@@ -141,8 +144,9 @@ _send_to(int fd, const void * buf, size_t sz, uint32_t handle) {
 	memcpy(buffer+2+sz+4,&u32,4);
 	u32 = 0;
 	memcpy(buffer+2+sz+8,&u32,4);
+	memcpy(buffer+2+sz+12,&u32,4);
 
-	sz += 2 + 12;
+	sz += 2 + HEADER_SIZE;
 
 	for (;;) {
 		int err = send(fd, buffer, sz, 0);
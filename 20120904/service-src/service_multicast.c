@@ -1,6 +1,7 @@
 #include "skynet.h"
 #include "skynet_handle.h"
 #include "skynet_multicast.h"
+#include "skynet_buffer.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -43,7 +44,11 @@ _maincb(struct skynet_context * context, void * ud, int type, int session, uint3
 		}
 		return 0;		
 	} else {
-		sz |= type << HANDLE_REMOTE_SHIFT;
+		// 保留共享 buffer 时要记住它是共享的，最后用 skynet_buffer_release 释放
+		if (skynet_message_shared()) {
+			type |= MESSAGE_TYPE_SHARED;
+		}
+		sz |= (size_t)type << HANDLE_REMOTE_SHIFT;
 		struct skynet_multicast_message * mc = skynet_multicast_create(msg, sz, source);
 		skynet_multicast_castgroup(context, g, mc);
 		return 1;
@@ -0,0 +1,15 @@
+local skynet = require "skynet"
+
+-- 周期性地把所有服务和 worker 的统计快照追加到文件中，格式见 skynet_server.c 的 _dump_stat 。
+-- 用法： skynet.launch("snlua", "statdump", [间隔秒数], [文件名])
+
+local interval, filename = ...
+interval = tonumber(interval) or 60
+filename = filename or "stat.log"
+
+skynet.start(function()
+	while true do
+		skynet.statdump(filename)
+		skynet.sleep(interval * 100)
+	end
+end)
@@ -0,0 +1,60 @@
+local skynet = require "skynet"
+local benchmark = require "benchmark"
+local pingpong = require "pingpong"
+
+-- cache miss 测试：用 perf_event 统计所有 worker 线程的 cache miss ，换算成每条消息的 miss 数。
+-- 两种负载：多个生产者同时发给本服务（生产者之间、生产者和消费者争用同一个队列），
+-- 以及若干对 ping / pong 服务来回调用（服务的 ref 和队列在不同 worker 之间传递）。
+-- 需要内核允许使用性能计数器，见 /proc/sys/kernel/perf_event_paranoid 。
+-- 用法： skynet.launch("snlua", "testcache", [生产者数], [每个生产者的消息数], [ping/pong 对数])
+
+local mode, arg1, arg2 = ...
+
+if mode == "producer" then
+	benchmark.worker(function(hub, count)
+		for i = 1, count do
+			skynet.send(hub, "text", "")
+		end
+	end)
+	return
+end
+
+if pingpong.service(mode) then
+	return
+end
+
+local producer = tonumber(mode) or 8
+local count = tonumber(arg1) or 100000
+local npair = tonumber(arg2) or 8
+
+local function measure(name, messages, f)
+	if not skynet.perf_start() then
+		print("perf counters are not available, run with a lower kernel.perf_event_paranoid")
+		return
+	end
+	local elapsed = f()
+	local miss = skynet.perf_stop()
+	print(string.format("%s messages = %d time = %dms cache-misses = %d per message = %.2f",
+		name, messages, math.floor(elapsed / 1000), miss, miss / messages))
+end
+
+skynet.start(function()
+	skynet.dispatch("text", function() end)
+	local self = skynet.self()
+
+	local handles = {}
+	for i = 1, producer do
+		handles[i] = benchmark.launch(nil, "testcache", "producer")
+	end
+	measure("fan-in", producer * count, function()
+		return benchmark.run(handles, function()
+			return self, count
+		end)
+	end)
+	benchmark.kill(handles)
+
+	measure("ping-pong", npair * count * 2, function()
+		return pingpong.run("testcache", npair, count, 0)
+	end)
+	skynet.exit()
+end)
@@ -0,0 +1,44 @@
+local skynet = require "skynet"
+
+-- skynet.forward 测试： proxy 在处理函数里直接转发给 echo ，调用者应该收到 echo 的应答；
+-- 先 skynet.call 再转发时，回调里已经是 call 的应答，转发必须被拒绝，原来的请求也不能丢。
+-- 用法： skynet.launch("snlua", "testforward")
+
+local mode, arg1 = ...
+
+if mode == "echo" then
+	skynet.start(function()
+		skynet.dispatch("text", function(session, source, msg)
+			skynet.ret(msg)
+		end)
+	end)
+	return
+end
+
+if mode == "proxy" then
+	local echo = tonumber(arg1)
+	skynet.start(function()
+		skynet.dispatch("text", function(session, source, msg)
+			if msg == "late" then
+				skynet.call(echo, "text", "before forward")
+				local ok = pcall(skynet.forward, echo)
+				skynet.ret(ok and "forwarded" or "refused")
+			else
+				skynet.forward(echo)
+			end
+		end)
+	end)
+	return
+end
+
+skynet.start(function()
+	local echo = skynet.launch("snlua", "testforward", "echo")
+	local proxy = skynet.launch("snlua", "testforward", "proxy", echo)
+	local r1 = skynet.call(proxy, "text", "hello")
+	local r2 = skynet.call(proxy, "text", "late")
+	print(string.format("forward in dispatch : %s, forward after call : %s", r1, r2))
+	assert(r1 == "hello" and r2 == "refused")
+	skynet.kill(skynet.address(proxy))
+	skynet.kill(skynet.address(echo))
+	skynet.exit()
+end)
@@ -0,0 +1,57 @@
+local skynet = require "skynet"
+
+-- handle 查询压力测试：和 worker 一样多的发送者同时向同一个 sink 服务发消息，
+-- 每次 skynet.send 都要 skynet_handle_grab 一次 sink 。发送者只统计自己发送循环的用时，
+-- 打印总的发送速率和每次发送的平均耗时。
+-- 改变 config 里的 thread （ 1, 2, 4 ... 64 ）分别运行，就是对线程数的扫描。
+-- 脚本只用到 skynet_handle_grab 改成无锁之前就有的接口，可以在修改前后的代码上各跑一遍对比。
+-- 用法： skynet.launch("snlua", "testgrab", [每个发送者的消息数])
+
+local mode, sink, count, main = ...
+
+if mode == "sink" then
+	skynet.start(function()
+		skynet.dispatch("text", function() end)
+	end)
+	return
+end
+
+if mode == "sender" then
+	skynet.start(function()
+		sink, count, main = tonumber(sink), tonumber(count), tonumber(main)
+		local start = skynet.now()
+		for i = 1, count do
+			skynet.send(sink, "text", "")
+		end
+		skynet.send(main, "text", skynet.now() - start)
+		skynet.exit()
+	end)
+	return
+end
+
+count = tonumber(mode) or 100000
+
+skynet.start(function()
+	local n = tonumber(skynet.getenv "thread")
+	local finished = 0
+	local elapsed = 0
+	skynet.dispatch("text", function(session, source, ti)
+		finished = finished + 1
+		elapsed = elapsed + tonumber(ti)
+	end)
+	local self = skynet.self()
+	local target = skynet.launch("snlua", "testgrab", "sink")
+	local start = skynet.now()
+	for i = 1, n do
+		skynet.launch("snlua", "testgrab", "sender", target, count, self)
+	end
+	while finished < n do
+		skynet.sleep(10)
+	end
+	local wall = math.max(skynet.now() - start, 1)
+	local total = n * count
+	print(string.format("threads = %d sends = %d time = %d0ms rate = %d/s cost = %dns/send",
+		n, total, wall, math.floor(total * 100 / wall), math.floor(elapsed * 10000000 / total)))
+	skynet.kill(skynet.address(target))
+	skynet.exit()
+end)
@@ -0,0 +1,58 @@
+local skynet = require "skynet"
+
+-- 定时器误差测试：同时挂起大量 sleep_ms ，用微秒时钟统计实际唤醒比预期晚了多少，
+-- 打印误差的分位数和按 2 的幂分段的直方图。误差的下限是定时器的嘀嗒长度（见 config 的 timer_tick ）。
+-- 用法： skynet.launch("snlua", "testjitter", [并发数], [每个协程的次数], [最长的 sleep 毫秒数])
+
+local concurrent, rounds, longest = ...
+concurrent = tonumber(concurrent) or 1000
+rounds = tonumber(rounds) or 10
+longest = tonumber(longest) or 3000
+
+local deviation = {}
+local finished = 0
+
+local function sleeper()
+	for i = 1, rounds do
+		local ms = math.random(1, longest)
+		local start = skynet.now_us()
+		skynet.sleep_ms(ms)
+		table.insert(deviation, skynet.now_us() - start - ms * 1000)
+	end
+	finished = finished + 1
+end
+
+local function percentile(sorted, p)
+	local i = math.ceil(#sorted * p)
+	return sorted[math.max(i, 1)]
+end
+
+skynet.start(function()
+	for i = 1, concurrent do
+		skynet.fork(sleeper)
+	end
+	while finished < concurrent do
+		skynet.sleep(100)
+	end
+	table.sort(deviation)
+	print(string.format("timers = %d min = %dus p50 = %dus p90 = %dus p99 = %dus p99.9 = %dus max = %dus",
+		#deviation, deviation[1], percentile(deviation, 0.5), percentile(deviation, 0.9),
+		percentile(deviation, 0.99), percentile(deviation, 0.999), deviation[#deviation]))
+
+	local histogram = {}
+	local top = 0
+	for _, d in ipairs(deviation) do
+		local bucket = 0
+		while d >= 2 ^ bucket do
+			bucket = bucket + 1
+		end
+		histogram[bucket] = (histogram[bucket] or 0) + 1
+		top = math.max(top, bucket)
+	end
+	for bucket = 0, top do
+		if histogram[bucket] then
+			print(string.format("< %8dus : %d", 2 ^ bucket, histogram[bucket]))
+		end
+	end
+	skynet.exit()
+end)
@@ -0,0 +1,43 @@
+local skynet = require "skynet"
+local benchmark = require "benchmark"
+
+-- 消息队列压力测试：1, 2, 4 ... 个生产者各绑定在一个 worker 上，同时向本服务发消息，
+-- 多个线程同时 push 同一个队列，本服务所在的 worker 同时在 pop 。打印本服务的收包速率。
+-- 生产者只用编号 1 以后的 worker ，留一个给本服务，所以最多 thread - 1 个生产者。
+-- 用法： skynet.launch("snlua", "testmq", [每个生产者的消息数])
+
+local mode = ...
+
+if mode == "producer" then
+	benchmark.worker(function(hub, count)
+		for i = 1, count do
+			skynet.send(hub, "text", i)
+		end
+	end)
+	return
+end
+
+local count = tonumber(mode) or 100000
+local received = 0
+
+skynet.start(function()
+	skynet.dispatch("text", function()
+		received = received + 1
+	end)
+	local self = skynet.self()
+	for _, n in ipairs(benchmark.threads(1)) do
+		local producer = {}
+		for i = 1, n do
+			producer[i] = benchmark.launch(i, "testmq", "producer")
+		end
+		received = 0
+		-- 生产者的应答排在它发的消息之后，全部返回时消息已经收完
+		local elapsed = benchmark.run(producer, function()
+			return self, count
+		end)
+		benchmark.kill(producer)
+		print(string.format("producers = %d messages = %d time = %dms rate = %d/s",
+			n, received, math.floor(elapsed / 1000), math.floor(received * 1000000 / elapsed)))
+	end
+	skynet.exit()
+end)
@@ -0,0 +1,34 @@
+local skynet = require "skynet"
+local pingpong = require "pingpong"
+
+-- NUMA 放置测试：启动若干对 ping / pong 服务，每次往返带一块 4KB 的数据。
+-- local 模式下每对服务绑定在同一个节点上，interleaved 模式下两边分在相邻的两个节点上，
+-- 对比两种放置下的往返速率。需要在 config 里打开 numa ，只有一个节点时两种模式没有区别。
+-- 用法： skynet.launch("snlua", "testnuma", [服务对数], [每对的往返次数])
+
+local mode, arg1 = ...
+
+if pingpong.service(mode) then
+	return
+end
+
+local npair = tonumber(mode) or 8
+local rounds = tonumber(arg1) or 10000
+
+local function bench(interleaved, nodes)
+	local elapsed = pingpong.run("testnuma", npair, rounds, 4096, function(i)
+		local node = (i - 1) % nodes
+		local peer = interleaved and (node + 1) % nodes or node
+		return "node:" .. node, "node:" .. peer
+	end)
+	print(string.format("%s nodes = %d pairs = %d rounds = %d time = %dms rate = %d/s",
+		interleaved and "interleaved" or "local", nodes, npair, npair * rounds,
+		math.floor(elapsed / 1000), math.floor(npair * rounds * 1000000 / elapsed)))
+end
+
+skynet.start(function()
+	local nodes = skynet.nodes()
+	bench(false, nodes)
+	bench(true, nodes)
+	skynet.exit()
+end)
@@ -0,0 +1,152 @@
+local skynet = require "skynet"
+
+-- 过载通知测试：由 gate 、 client 和 connection 这些 C 服务喂数据的 lua 服务把队列压过高水位，节点不能因此退出。
+-- 本服务是 gate 的 watchdog ，两个 feeder 服务通过 connection 连上 gate ：
+-- 第一个连接转发给 agent ， agent 把每个包经 client 服务原样写回， feeder 再经 connection 收到；
+-- 第二个连接不转发，数据由 gate 直接发给本服务。
+-- 本服务、 agent 和 feeder 都把高水位设得很低并且处理得很慢，它们要求了过载通知，应该各自收到；
+-- 三个队列的发送者 gate 、 client 和 connection 没有要求，不会收到。
+-- 需要 main 里启动的 connection 服务。
+-- 用法： skynet.launch("snlua", "testoverload", [端口], [每个连接的包数])
+
+local mode, arg1, arg2 = ...
+
+local HIGHWATER = 8
+
+local function slow()
+	local t = os.clock() + 0.002
+	while os.clock() < t do end
+end
+
+if mode == "agent" then
+	local client = tonumber(arg1)
+	local overload = 0
+	skynet.register_protocol {
+		name = "client",
+		id = 3,
+		unpack = skynet.tostring,
+		dispatch = function(session, source, msg)
+			slow()
+			skynet.send(client, "text", msg)
+		end
+	}
+	skynet.start(function()
+		skynet.mqlimit(HIGHWATER)
+		skynet.dispatch("overload", function()
+			overload = overload + 1
+		end)
+		skynet.dispatch("lua", function()
+			skynet.ret(skynet.pack(overload))
+		end)
+	end)
+	return
+end
+
+if mode == "feeder" then
+	local socket = require "socket"
+	local received = 0
+	local overload = 0
+	local function count()
+		return true
+	end
+	skynet.register_protocol {
+		name = "client",
+		id = 3,
+		unpack = function(msg, sz)
+			assert(msg, "connection closed")
+			socket.push(msg, sz)
+		end,
+		dispatch = function()
+			slow()
+			while socket.readblock(count) do
+				received = received + 1
+			end
+		end
+	}
+	skynet.start(function()
+		skynet.mqlimit(HIGHWATER)
+		skynet.dispatch("overload", function()
+			overload = overload + 1
+		end)
+		-- "connect" 连上 gate ， "send" 发出 n 个包，并等 echo 个包写回
+		skynet.dispatch("lua", function(session, source, cmd, n, echo)
+			if cmd == "connect" then
+				assert(not socket.connect("127.0.0.1:" .. arg1), "can't connect to gate")
+			else
+				for i = 1, n do
+					socket.writeblock("packet " .. i)
+				end
+				while received < echo do
+					skynet.sleep(10)
+				end
+			end
+			skynet.ret(skynet.pack(overload, received))
+		end)
+	end)
+	return
+end
+
+local port = tonumber(mode) or 8889
+local count = tonumber(arg1) or 200
+
+skynet.start(function()
+	local gate
+	local opened = 0
+	local agent, client
+	local data = 0
+	local overload = 0
+
+	skynet.mqlimit(HIGHWATER)
+	skynet.dispatch("overload", function()
+		overload = overload + 1
+	end)
+	skynet.dispatch("text", function(session, source, message)
+		local id, cmd, parm = string.match(message, "(%d+) (%w+) ?(.*)")
+		if cmd == "open" then
+			opened = opened + 1
+			if opened == 1 then
+				local fd = string.match(parm, "(%d+)")
+				client = skynet.launch("client", fd)
+				agent = skynet.launch("snlua", "testoverload", "agent", client)
+				skynet.send(gate, "text", "forward", id, skynet.address(agent), skynet.address(client))
+			end
+		elseif cmd == "data" then
+			slow()
+			data = data + 1
+		end
+	end)
+
+	gate = skynet.launch("gate", skynet.address(skynet.self()), port, 0, 4, 0)
+	skynet.send(gate, "text", "start")
+
+	-- 先连接，等 forward 发给 gate 之后再发数据，数据才不会在转发之前漏到本服务
+	local feeder = {}
+	for i = 1, 2 do
+		feeder[i] = skynet.launch("snlua", "testoverload", "feeder", port)
+		skynet.call(feeder[i], "lua", "connect")
+		while opened < i do
+			skynet.sleep(10)
+		end
+	end
+
+	local result = {}
+	local finished = 0
+	for i = 1, 2 do
+		skynet.fork(function()
+			result[i] = { skynet.call(feeder[i], "lua", "send", count, i == 1 and count or 0) }
+			finished = finished + 1
+		end)
+	end
+	while finished < 2 or data < count do
+		skynet.sleep(10)
+	end
+	local agent_overload = skynet.call(agent, "lua")
+
+	print(string.format("node survived : echo = %d/%d data = %d/%d overload events : agent = %d feeder = %d watchdog = %d",
+		result[1][2], count, data, count, agent_overload, result[1][1], overload))
+
+	for _, handle in ipairs { feeder[1], feeder[2], agent, client, gate } do
+		skynet.kill(skynet.address(handle))
+	end
+	skynet.exit()
+end)
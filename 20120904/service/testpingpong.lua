@@ -0,0 +1,33 @@
+local skynet = require "skynet"
+local pingpong = require "pingpong"
+
+-- 请求/应答延迟测试：若干对 ping / pong 服务用 skynet.call 来回传一个小包，
+-- 分别在关闭和打开直接交接 (handoff) 时各跑一遍，打印总速率和平均往返时间。
+-- 结束后恢复成 config 里的 handoff 设置。
+-- 用法： skynet.launch("snlua", "testpingpong", [服务对数], [每对的往返次数], [交接上限])
+
+local mode, arg1, arg2 = ...
+
+if pingpong.service(mode) then
+	return
+end
+
+local npair = tonumber(mode) or 1
+local rounds = tonumber(arg1) or 100000
+local limit = tonumber(arg2) or 16
+
+local function bench(handoff)
+	skynet.handoff(handoff)
+	local elapsed = pingpong.run("testpingpong", npair, rounds, 4)
+	local total = npair * rounds
+	print(string.format("handoff = %d pairs = %d calls = %d time = %dms rate = %d/s latency = %.2fus",
+		handoff, npair, total, math.floor(elapsed / 1000), math.floor(total * 1000000 / elapsed),
+		elapsed / rounds))
+end
+
+skynet.start(function()
+	bench(0)
+	bench(limit)
+	skynet.handoff(tonumber(skynet.getenv "handoff") or 0)
+	skynet.exit()
+end)
@@ -0,0 +1,65 @@
+local skynet = require "skynet"
+
+-- 调度优先级测试：用低优先级的忙碌服务占满所有 worker ，
+-- 同时每 10ms 给一个高优先级和一个普通优先级的探测服务各发一条追踪消息，
+-- 结束后把追踪记录写入文件，对比两个探测服务排队延迟的 p50 / p99 。
+-- 用法： skynet.launch("snlua", "testpriority", [忙碌服务数], [探测次数], [输出文件])
+
+local mode, arg1 = ...
+
+if mode == "load" then
+	-- 每条消息空转一会儿再发给自己，始终保持队列非空
+	local spin = tonumber(arg1)
+	skynet.start(function()
+		skynet.priority(nil, "low")
+		local self = skynet.self()
+		skynet.dispatch("text", function()
+			local x = 0
+			for i = 1, spin do
+				x = x + i
+			end
+			skynet.send(self, "text", "")
+		end)
+		for i = 1, 4 do
+			skynet.send(self, "text", "")
+		end
+	end)
+	return
+end
+
+if mode == "probe" then
+	skynet.start(function()
+		skynet.priority(nil, arg1)
+		skynet.dispatch("text", function() end)
+	end)
+	return
+end
+
+local load = tonumber(mode) or 32
+local count = tonumber(arg1) or 1000
+local filename = select(3, ...) or "testpriority.trace"
+
+skynet.start(function()
+	local loader = {}
+	for i = 1, load do
+		loader[i] = skynet.launch("snlua", "testpriority", "load", 10000)
+	end
+	local high = skynet.launch("snlua", "testpriority", "probe", "high")
+	local normal = skynet.launch("snlua", "testpriority", "probe", "normal")
+	-- 等忙碌服务把 worker 占满
+	skynet.sleep(100)
+	for i = 1, count do
+		skynet.trace()
+		skynet.send(high, "text", "")
+		skynet.send(normal, "text", "")
+		skynet.sleep(1)
+	end
+	skynet.tracedump(filename)
+	print(string.format("load = %d probes = %d high = :%08x normal = :%08x, see 'queue' lines in %s", load, count, high, normal, filename))
+	for i = 1, load do
+		skynet.kill(string.format(":%x", loader[i]))
+	end
+	skynet.kill(string.format(":%x", high))
+	skynet.kill(string.format(":%x", normal))
+	skynet.exit()
+end)
@@ -0,0 +1,59 @@
+local skynet = require "skynet"
+
+-- 模拟模式测试：在 config 里设置 simulate = 种子 后运行。
+-- 若干个 agent 每隔一段（模拟的）时间给 hub 发一条消息，跑满一天的模拟时间，
+-- 打印模拟时间、实际花费的 cpu 时间和 hub 收到的消息序列的校验值。
+-- 同一个种子多次运行的校验值应该相同，换一个种子调度顺序就会不同。
+-- 用法： skynet.launch("snlua", "testsimulate", [agent 数], [模拟的秒数], [间隔，单位 10ms])
+
+local mode, arg1, arg2, arg3 = ...
+
+if mode == "agent" then
+	skynet.start(function()
+		local hub, stop, interval = tonumber(arg1), tonumber(arg2), tonumber(arg3)
+		local id = skynet.self()
+		while skynet.now() < stop do
+			skynet.sleep(interval)
+			skynet.send(hub, "text", id)
+		end
+		skynet.send(hub, "text", "done")
+	end)
+	return
+end
+
+local agent = tonumber(mode) or 100
+local seconds = tonumber(arg1) or 86400
+local interval = tonumber(arg2) or 6000
+
+skynet.start(function()
+	local received = 0
+	local finished = 0
+	local checksum = 0
+	local waiting
+	skynet.dispatch("text", function(session, source, msg)
+		if msg == "done" then
+			finished = finished + 1
+			if finished == agent and waiting then
+				skynet.wakeup(waiting)
+			end
+		else
+			received = received + 1
+			checksum = (checksum * 31 + tonumber(msg)) % 4294967296
+		end
+	end)
+	local self = tostring(skynet.self())
+	local start = skynet.now()
+	local clock = os.clock()
+	local stop = start + seconds * 100
+	for i = 1, agent do
+		skynet.launch("snlua", "testsimulate", "agent", self, stop, interval)
+	end
+	waiting = coroutine.running()
+	while finished < agent do
+		skynet.sleep(100)
+	end
+	waiting = nil
+	print(string.format("agents = %d simulated = %ds cpu = %.2fs messages = %d checksum = %08x",
+		agent, math.floor((skynet.now() - start) / 100), os.clock() - clock, received, checksum))
+	skynet.exit()
+end)
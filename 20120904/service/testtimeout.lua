@@ -0,0 +1,46 @@
+local skynet = require "skynet"
+local c = require "skynet.c"
+local benchmark = require "benchmark"
+
+-- TIMEOUT 压力测试：1, 2, 4 ... 个服务各绑定在一个 worker 上，同时连续调用 TIMEOUT ，
+-- 分别测 TIMEOUT 0 （直接投递应答）和 TIMEOUT n （插入时间轮）。
+-- 打印总的调用速率和每次调用的平均耗时，线程增加时平均耗时上升说明调用之间在争用。
+-- 用法： skynet.launch("snlua", "testtimeout", [每个服务的调用次数], [TIMEOUT 参数，默认 0 和 100 各测一遍])
+
+local mode, ti = ...
+
+if mode == "caller" then
+	skynet.dispatch_unknown_response(function() end)
+	benchmark.worker(function(count, ti)
+		for i = 1, count do
+			c.command("TIMEOUT", ti)
+		end
+	end)
+	return
+end
+
+local count = tonumber(mode) or 100000
+local param = ti and { ti } or { "0", "100" }
+
+skynet.start(function()
+	for _, ti in ipairs(param) do
+		for _, n in ipairs(benchmark.threads()) do
+			local caller = {}
+			for i = 1, n do
+				caller[i] = benchmark.launch(i - 1, "testtimeout", "caller")
+			end
+			local elapsed, self = benchmark.run(caller, function()
+				return count, ti
+			end)
+			local cost = 0
+			for i = 1, n do
+				cost = cost + self[i]
+			end
+			benchmark.kill(caller)
+			print(string.format("TIMEOUT %s threads = %d calls = %d time = %dms rate = %d/s cost = %dns/call",
+				ti, n, n * count, math.floor(elapsed / 1000), math.floor(n * count * 1000000 / elapsed),
+				math.floor(cost * 1000 / (n * count))))
+		end
+	end
+	skynet.exit()
+end)
@@ -10,8 +10,11 @@
 #define PTYPE_CLIENT 3
 #define PTYPE_SYSTEM 4
 #define PTYPE_HARBOR 5
+#define PTYPE_OVERLOAD 6
+#define PTYPE_DEBUG 7
 #define PTYPE_TAG_DONTCOPY 0x10000
 #define PTYPE_TAG_ALLOCSESSION 0x20000
+#define PTYPE_TAG_SHARED 0x40000
 
 struct skynet_context;
 
@@ -21,7 +24,43 @@ uint32_t skynet_queryname(struct skynet_context * context, const char * name);
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
 int skynet_sendname(struct skynet_context * context, const char * destination , int type, int session, void * msg, size_t sz);
 
-void skynet_forward(struct skynet_context *, uint32_t destination);
+/*
+ 把正在处理的消息转发给 destination ，回调返回后生效。一条消息只能转发一次，重复调用返回 -1 。
+*/
+int skynet_forward(struct skynet_context *, uint32_t destination);
+
+/*
+ 消息数据的分配器。以 PTYPE_TAG_DONTCOPY 发送的数据必须由 skynet_malloc 分配，
+ 回调返回非 0 保留下来的消息数据用 skynet_free 释放。
+*/
+void * skynet_malloc(size_t sz);
+void skynet_free(void * ptr);
+/*
+ 服务模块自己管理的内存（比如 lua 虚拟机）用它报告当前的总字节数，计入 MEM 命令的统计。
+*/
+void skynet_memory_report(struct skynet_context * context, size_t sz);
+
+/*
+ 引用计数的共享 buffer ，内容创建后只读。
+ 以 PTYPE_TAG_SHARED 发送时不复制，发送会转移调用者的一个引用，
+ 所以同一个 buffer 发给多个目标时，每次发送前都要 grab 一次。
+ 接收方的回调返回非 0 保留消息时，如果 skynet_message_shared 为真，
+ 要用 skynet_buffer_release 而不是 skynet_free 释放它。
+*/
+void * skynet_buffer_new(size_t sz);
+void skynet_buffer_grab(void * buffer);
+void skynet_buffer_release(void * buffer);
+/*
+ 当前回调正在处理的消息数据是否是共享 buffer ，只在回调中有效。
+*/
+int skynet_message_shared(void);
+/*
+ 当前线程正在处理的消息的追踪 id ， 0 表示不追踪。
+ 回调中发出的消息会继承它，转发远程消息的服务（比如 harbor ）需要自己设置。
+*/
+uint32_t skynet_trace_current(void);
+void skynet_trace_set(uint32_t trace);
+
 int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 
 typedef int (*skynet_cb)(struct skynet_context * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
@@ -0,0 +1,68 @@
+#include "skynet.h"
+#include "skynet_buffer.h"
+#include "skynet_harbor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// 引用计数放在数据之前，保证数据 8 字节对齐
+struct shared_buffer {
+	int ref;
+	int reserved;
+};
+
+#define HEADER(ptr) ((struct shared_buffer *)(ptr) - 1)
+
+/*
+ 分配 sz 字节的共享 buffer ，引用计数为 1 。
+ 末尾多分配一个 '\0' ，和普通消息一样可以当作字符串读取。
+*/
+void *
+skynet_buffer_new(size_t sz) {
+	struct shared_buffer * b = skynet_malloc(sizeof(*b) + sz + 1);
+	b->ref = 1;
+	b->reserved = 0;
+	char * data = (char *)(b + 1);
+	data[sz] = '\0';
+	return data;
+}
+
+void
+skynet_buffer_grab(void * buffer) {
+	__sync_add_and_fetch(&HEADER(buffer)->ref, 1);
+}
+
+void
+skynet_buffer_release(void * buffer) {
+	if (buffer == NULL)
+		return;
+	struct shared_buffer * b = HEADER(buffer);
+	if (__sync_sub_and_fetch(&b->ref, 1) == 0) {
+		skynet_free(b);
+	}
+}
+
+void
+skynet_buffer_free(void * data, size_t sz) {
+	int type = sz >> HANDLE_REMOTE_SHIFT;
+	if (type & MESSAGE_TYPE_SHARED) {
+		skynet_buffer_release(data);
+	} else {
+		skynet_free(data);
+	}
+}
+
+void *
+skynet_buffer_unshare(void * data, size_t * sz) {
+	int type = *sz >> HANDLE_REMOTE_SHIFT;
+	if (!(type & MESSAGE_TYPE_SHARED)) {
+		return data;
+	}
+	size_t len = *sz & HANDLE_MASK;
+	char * msg = skynet_malloc(len + 1);
+	memcpy(msg, data, len);
+	msg[len] = '\0';
+	skynet_buffer_release(data);
+	*sz &= ~((size_t)MESSAGE_TYPE_SHARED << HANDLE_REMOTE_SHIFT);
+	return msg;
+}
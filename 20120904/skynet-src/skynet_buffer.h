@@ -0,0 +1,22 @@
+#ifndef SKYNET_BUFFER_H
+#define SKYNET_BUFFER_H
+
+#include <stddef.h>
+
+/*
+ 消息 sz 高 8 位存放消息类型，类型的最高位表示 data 是共享 buffer 。
+ 共享 buffer 不能直接 free ，要用 skynet_buffer_free 释放。
+*/
+#define MESSAGE_TYPE_SHARED 0x80
+
+/*
+ 释放一条消息的 data ，sz 是带有类型的 sz 。
+*/
+void skynet_buffer_free(void * data, size_t sz);
+/*
+ 如果 data 是共享 buffer ，复制一份独占的数据并释放掉共享的引用，同时清除 sz 中的共享标记。
+ 发往其他 harbor 的消息需要这样处理。
+*/
+void * skynet_buffer_unshare(void * data, size_t * sz);
+
+#endif
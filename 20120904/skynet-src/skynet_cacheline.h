@@ -0,0 +1,22 @@
+#ifndef SKYNET_CACHELINE_H
+#define SKYNET_CACHELINE_H
+
+#include <stdlib.h>
+
+/*
+ 不同线程频繁写入的字段放在不同的 cache line 上，避免伪共享。
+ 带 CACHE_ALIGNED 成员的结构必须用 skynet_cacheline_alloc 分配，普通 malloc 只保证 16 字节对齐。
+*/
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+static inline void *
+skynet_cacheline_alloc(size_t sz) {
+	void * ptr = NULL;
+	if (posix_memalign(&ptr, CACHE_LINE_SIZE, sz)) {
+		abort();
+	}
+	return ptr;
+}
+
+#endif
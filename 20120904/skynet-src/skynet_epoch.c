@@ -0,0 +1,115 @@
+#include "skynet_epoch.h"
+
+#include <stdlib.h>
+
+// 每个线程第一次进入时分配一个 record ，挂在全局链表上，永不释放
+struct epoch_record {
+	struct epoch_record * next;
+	int active;
+	unsigned epoch;
+};
+
+struct epoch_garbage {
+	struct epoch_garbage * next;
+	unsigned epoch;
+	void * ptr;
+};
+
+struct epoch {
+	unsigned epoch;
+	int lock;
+	struct epoch_record * record;
+	struct epoch_garbage * garbage;
+};
+
+static struct epoch E;
+static __thread struct epoch_record * R = NULL;
+
+#define LOCK(e) while (__sync_lock_test_and_set(&(e)->lock,1)) {}
+#define UNLOCK(e) __sync_lock_release(&(e)->lock);
+
+static struct epoch_record *
+_record() {
+	struct epoch_record * r = malloc(sizeof(*r));
+	r->active = 0;
+	r->epoch = 0;
+	for (;;) {
+		struct epoch_record * head = E.record;
+		r->next = head;
+		if (__sync_bool_compare_and_swap(&E.record, head, r))
+			break;
+	}
+	R = r;
+	return r;
+}
+
+void
+skynet_epoch_enter(void) {
+	struct epoch_record * r = R;
+	if (r == NULL) {
+		r = _record();
+	}
+	r->epoch = E.epoch;
+	r->active = 1;
+	// 让 active 先于之后的读操作可见，与 _advance 中的检查配对
+	__sync_synchronize();
+}
+
+void
+skynet_epoch_leave(void) {
+	__sync_lock_release(&R->active);
+}
+
+// 所有活跃的读者都已经看到当前 epoch 时才推进，调用时持有 E.lock
+static void
+_advance() {
+	unsigned epoch = E.epoch;
+	__sync_synchronize();
+	struct epoch_record * r = E.record;
+	while (r) {
+		if (r->active && r->epoch != epoch)
+			return;
+		r = r->next;
+	}
+	__sync_synchronize();
+	E.epoch = epoch + 1;
+}
+
+/*
+ ptr 必须已经对新的读者不可见。
+ 在 epoch e 摘除的对象，等全局 epoch 推进到 e+2 时释放。
+*/
+void
+skynet_epoch_retire(void *ptr) {
+	struct epoch_garbage * g = malloc(sizeof(*g));
+	g->ptr = ptr;
+
+	LOCK(&E)
+	g->epoch = E.epoch;
+	g->next = E.garbage;
+	E.garbage = g;
+
+	_advance();
+
+	unsigned epoch = E.epoch;
+	struct epoch_garbage ** p = &E.garbage;
+	struct epoch_garbage * free_list = NULL;
+	while (*p) {
+		g = *p;
+		if (epoch - g->epoch >= 2) {
+			*p = g->next;
+			g->next = free_list;
+			free_list = g;
+		} else {
+			p = &g->next;
+		}
+	}
+	UNLOCK(&E)
+
+	while (free_list) {
+		g = free_list;
+		free_list = g->next;
+		free(g->ptr);
+		free(g);
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef SKYNET_EPOCH_H
+#define SKYNET_EPOCH_H
+
+/*
+ 基于 epoch 的延迟回收。
+ 读者在 skynet_epoch_enter 与 skynet_epoch_leave 之间可以无锁地访问共享对象，
+ 写者将对象摘除后调用 skynet_epoch_retire ，对象会在所有读者离开之后才被 free 。
+*/
+
+void skynet_epoch_enter(void);
+void skynet_epoch_leave(void);
+void skynet_epoch_retire(void *ptr);
+
+#endif
@@ -38,8 +38,11 @@ skynet_error(struct skynet_context * context, const char *msg, ...) {
 		smsg.source = skynet_context_handle(context);
 	}
 	smsg.session = 0;
-	smsg.data = strdup(tmp);
+	smsg.data = skynet_malloc(len + 1);
+	memcpy(smsg.data, tmp, len + 1);
 	smsg.sz = len | (PTYPE_TEXT << HANDLE_REMOTE_SHIFT);
-	skynet_context_push(logger, &smsg);
+	if (skynet_context_push(logger, &smsg)) {
+		skynet_free(smsg.data);
+	}
 }
 
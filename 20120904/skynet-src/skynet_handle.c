@@ -1,5 +1,6 @@
 #include "skynet_handle.h"
 #include "skynet_server.h"
+#include "skynet_epoch.h"
 #include "rwlock.h"
 
 #include <stdlib.h>
@@ -7,27 +8,48 @@
 #include <string.h>
 
 #define DEFAULT_SLOT_SIZE 4
+#define DEFAULT_NAME_SIZE 16
 
+// 同时挂在按名字和按 handle 索引的两个哈希表中
 struct handle_name {
+	struct handle_name * next;
+	struct handle_name * handle_next;
 	char * name;
 	uint32_t handle;
 };
 
+// slot 数组与它的大小放在一起，扩容时整体替换，读者只需要读一次指针
+struct handle_slot {
+	int size;
+	struct skynet_context * ctx[1];
+};
+
 struct handle_storage {
 	struct rwlock lock;
 
 	uint32_t harbor;			// skynet 的 harbor id ，存储为高 8 位为 harbor id ，其余低位全是0
 	uint32_t handle_index;
-	int slot_size;
-	struct skynet_context ** slot;
+	struct handle_slot * slot;	// 写者持有写锁修改，读者在 epoch 保护下无锁读取
 	
+	struct rwlock name_lock;	// 名字表有独立的锁，不占用 handle 表的锁
 	int name_cap;
 	int name_count;
-	struct handle_name *name;
+	struct handle_name ** name;			// 以名字的 hash 索引
+	struct handle_name ** name_handle;	// 以 handle 索引，用于注销时删除名字
 };
 
 static struct handle_storage *H = NULL;
 
+static void _remove_name(struct handle_storage *s, uint32_t handle);
+
+static struct handle_slot *
+_new_slot(int size) {
+	struct handle_slot * slot = malloc(sizeof(*slot) + (size - 1) * sizeof(struct skynet_context *));
+	slot->size = size;
+	memset(slot->ctx, 0, size * sizeof(struct skynet_context *));
+	return slot;
+}
+
 /*
  注册并返回 handle id ，从 ctx 进化为服务。
  handle id 的格式为：最高 8 字节为 harbor id ，其余字节为 handle id
@@ -40,31 +62,34 @@ skynet_handle_register(struct skynet_context *ctx) {
 	
 	for (;;) {
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		struct handle_slot * slot = s->slot;
+		for (i=0;i<slot->size;i++) {
 			uint32_t handle = (i+s->handle_index) & HANDLE_MASK;
-			int hash = handle & (s->slot_size-1);
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			int hash = handle & (slot->size-1);
+			if (slot->ctx[hash] == NULL) {
 				s->handle_index = handle + 1;
+				handle |= s->harbor;
+				// 无锁的读者会直接比较 ctx 的 handle ，所以必须先初始化再放进 slot
+				skynet_context_init(ctx, handle);
+				__sync_synchronize();
+				slot->ctx[hash] = ctx;
 
 				rwlock_wunlock(&s->lock);
 
-				handle |= s->harbor;
-				skynet_context_init(ctx, handle);
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		assert((slot->size*2 - 1) <= HANDLE_MASK);
+		struct handle_slot * new_slot = _new_slot(slot->size * 2);
+		for (i=0;i<slot->size;i++) {
+			int hash = skynet_context_handle(slot->ctx[i]) & (new_slot->size - 1);
+			assert(new_slot->ctx[hash] == NULL);
+			new_slot->ctx[hash] = slot->ctx[i];
 		}
-		free(s->slot);
+		__sync_synchronize();
 		s->slot = new_slot;
-		s->slot_size *= 2;
+		// 旧数组可能还有读者在用
+		skynet_epoch_retire(slot);
 	}
 }
 
@@ -77,51 +102,97 @@ skynet_handle_retire(uint32_t handle) {
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	uint32_t hash = handle & (s->slot->size-1);
+	struct skynet_context * ctx = s->slot->ctx[hash];
+
+	if (ctx && skynet_context_handle(ctx) == handle) {
+		// 先从 slot 中摘除，之后的 grab 就不会再拿到它
+		s->slot->ctx[hash] = NULL;
+	} else {
+		ctx = NULL;
+	}
+
+	rwlock_wunlock(&s->lock);
+
+	if (ctx) {
+		rwlock_wlock(&s->name_lock);
+		_remove_name(s, handle);
+		rwlock_wunlock(&s->name_lock);
 
-	if (skynet_context_handle(ctx) == handle) {
+		skynet_context_retire(ctx);
 		skynet_context_release(ctx);
-		s->slot[hash] = NULL;
-		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
-			}
-			++j;
+	}
+}
+
+/*
+ 对每个服务调用一次 cb ，调用期间持有 ctx 的引用。
+ 不加锁，遍历的是当时的 slot 数组，期间新注册的服务可能遍历不到。
+*/
+void
+skynet_handle_foreach(void (*cb)(struct skynet_context *, void *), void *ud) {
+	struct handle_storage *s = H;
+	int i;
+
+	skynet_epoch_enter();
+
+	struct handle_slot * slot = s->slot;
+	for (i=0;i<slot->size;i++) {
+		struct skynet_context * ctx = slot->ctx[i];
+		if (ctx && skynet_context_trygrab(ctx)) {
+			cb(ctx, ud);
+			skynet_context_release(ctx);
 		}
-		s->name_count = j;
 	}
 
-	rwlock_wunlock(&s->lock);
+	skynet_epoch_leave();
 }
 
 /*
- 获取 handle 对应的 ctx
+ 获取 handle 对应的 ctx 。
+ 不加锁，slot 数组和 ctx 的内存由 epoch 保证在读取期间不会被释放；
+ 引用计数已经归零的 ctx 正在销毁，视为不存在。
 */
 struct skynet_context * 
 skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
 
-	rwlock_rlock(&s->lock);
+	skynet_epoch_enter();
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot * slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = slot->ctx[hash];
 	if (ctx && skynet_context_handle(ctx) == handle) {
-		result = ctx;
-		skynet_context_grab(result);
+		result = skynet_context_trygrab(ctx);
 	}
 
-	rwlock_runlock(&s->lock);
+	skynet_epoch_leave();
 
 	return result;
 }
 
+static unsigned
+_name_hash(const char * name) {
+	unsigned h = 0;
+	const unsigned char * p = (const unsigned char *)name;
+	while (*p) {
+		h = h ^ ((h<<5) + (h>>2) + *p);
+		++p;
+	}
+	return h;
+}
+
+static struct handle_name *
+_find_name(struct handle_storage *s, const char * name) {
+	struct handle_name * n = s->name[_name_hash(name) & (s->name_cap-1)];
+	while (n) {
+		if (strcmp(n->name, name) == 0)
+			return n;
+		n = n->next;
+	}
+	return NULL;
+}
+
 /*
  获取 name 对应的 handle 。失败则返回 0 。
 */
@@ -129,93 +200,113 @@ uint32_t
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
 
-	rwlock_rlock(&s->lock);
+	rwlock_rlock(&s->name_lock);
 
 	uint32_t handle = 0;
-
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	struct handle_name * n = _find_name(s, name);
+	if (n) {
+		handle = n->handle;
 	}
 
-	rwlock_runlock(&s->lock);
+	rwlock_runlock(&s->name_lock);
 
 	return handle;
 }
 
+static struct handle_name **
+_new_buckets(int cap) {
+	struct handle_name ** b = malloc(cap * sizeof(struct handle_name *));
+	memset(b, 0, cap * sizeof(struct handle_name *));
+	return b;
+}
+
 static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		struct handle_name * n = malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>=before;i--) {
-			s->name[i] = s->name[i-1];
+_expand_name(struct handle_storage *s) {
+	int cap = s->name_cap * 2;
+	struct handle_name ** name = _new_buckets(cap);
+	struct handle_name ** name_handle = _new_buckets(cap);
+	int i;
+	for (i=0;i<s->name_cap;i++) {
+		struct handle_name * n = s->name[i];
+		while (n) {
+			struct handle_name * next = n->next;
+			int hash = _name_hash(n->name) & (cap-1);
+			n->next = name[hash];
+			name[hash] = n;
+
+			hash = n->handle & (cap-1);
+			n->handle_next = name_handle[hash];
+			name_handle[hash] = n;
+			n = next;
 		}
 	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	free(s->name);
+	free(s->name_handle);
+	s->name = name;
+	s->name_handle = name_handle;
+	s->name_cap = cap;
 }
 
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			return NULL;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	if (_find_name(s, name)) {
+		return NULL;
+	}
+	if (s->name_count >= s->name_cap) {
+		_expand_name(s);
 	}
-	char * result = strdup(name);
+	struct handle_name * n = malloc(sizeof(*n));
+	n->name = strdup(name);
+	n->handle = handle;
 
-	_insert_name_before(s, result, handle, begin);
+	int hash = _name_hash(name) & (s->name_cap-1);
+	n->next = s->name[hash];
+	s->name[hash] = n;
 
-	return result;
+	hash = handle & (s->name_cap-1);
+	n->handle_next = s->name_handle[hash];
+	s->name_handle[hash] = n;
+
+	s->name_count ++;
+
+	return n->name;
+}
+
+// 通过反向索引删除 handle 的所有名字
+static void
+_remove_name(struct handle_storage *s, uint32_t handle) {
+	struct handle_name ** p = &s->name_handle[handle & (s->name_cap-1)];
+	while (*p) {
+		struct handle_name * n = *p;
+		if (n->handle != handle) {
+			p = &n->handle_next;
+			continue;
+		}
+		*p = n->handle_next;
+
+		struct handle_name ** q = &s->name[_name_hash(n->name) & (s->name_cap-1)];
+		while (*q != n) {
+			q = &(*q)->next;
+		}
+		*q = n->next;
+
+		free(n->name);
+		free(n);
+		s->name_count --;
+	}
 }
 
 /*
  为 handle 添加 name 别名。
  如果 name 已存在则返回 NULL ，否则返回 name 。
- 名字是排序存储的。
 */
 const char * 
 skynet_handle_namehandle(uint32_t handle, const char *name) {
-	rwlock_wlock(&H->lock);
+	rwlock_wlock(&H->name_lock);
 
 	const char * ret = _insert_name(H, name, handle);
 
-	rwlock_wunlock(&H->lock);
+	rwlock_wunlock(&H->name_lock);
 
 	return ret;
 }
@@ -227,17 +318,17 @@ void
 skynet_handle_init(int harbor) {
 	assert(H==NULL);
 	struct handle_storage * s = malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	s->slot = _new_slot(DEFAULT_SLOT_SIZE);
 
 	rwlock_init(&s->lock);
+	rwlock_init(&s->name_lock);
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
+	s->name_cap = DEFAULT_NAME_SIZE;
 	s->name_count = 0;
-	s->name = malloc(s->name_cap * sizeof(struct handle_name));
+	s->name = _new_buckets(s->name_cap);
+	s->name_handle = _new_buckets(s->name_cap);
 
 	H = s;
 
@@ -20,6 +20,10 @@ void skynet_handle_retire(uint32_t handle);
  获取 handle 对应的 ctx
 */
 struct skynet_context * skynet_handle_grab(uint32_t handle);
+/*
+ 对每个服务调用一次 cb
+*/
+void skynet_handle_foreach(void (*cb)(struct skynet_context *, void *), void *ud);
 
 /*
  获取 name 对应的 handle 。失败则返回 0 。
@@ -28,7 +32,6 @@ uint32_t skynet_handle_findname(const char * name);
 /*
  为 handle 添加 name 别名。
  如果 name 已存在则返回 NULL ，否则返回 name 。
- 名字是排序存储的。
 */
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
 
@@ -1,9 +1,17 @@
 #ifndef SKYNET_IMP_H
 #define SKYNET_IMP_H
 
+#include <stdint.h>
+
 struct skynet_config {
-	int thread;
+	int thread;	// thread_min 不为 0 时是 worker 数的上限
+	int thread_min;	// 不为 0 时按负载在 [thread_min, thread] 之间调整参与调度的 worker 数
+	int timer_tick;	// 定时器一个嘀嗒的毫秒数 (1/5/10)
+	int simulate;	// 不为 0 时以模拟模式运行，值是调度顺序的种子
+	int batch;	// 每个服务每轮处理的消息数， 0 表示按队列长度和 worker 权重决定
+	int handoff;	// worker 连续直接处理自己唤醒的服务的次数上限， 0 表示关闭
 	int mqueue_size;
+	int mqueue_highwater;	// 二级消息队列的默认高水位， 0 表示不限制
 	int harbor;
 	const char * logger;
 	const char * module_path;
@@ -11,8 +19,27 @@ struct skynet_config {
 	const char * local;
 	const char * start;
 	const char * standalone;
+	const char * schedule;	// "global" 所有 worker 共享一个全局队列， "steal" 每个 worker 一个本地队列并互相窃取
+	int cpu_affinity;	// 不为 0 时把每个 worker 线程绑定到一个 cpu 上
+	int numa;	// 不为 0 时按 NUMA 节点给 worker 分组，每组有自己的全局队列
+	int stall_threshold;	// 回调超过这么多毫秒时报告， 0 表示不监视
+	int stall_traceback;	// 不为 0 时报告卡住的同时让 lua 服务打印调用栈
 };
 
 void skynet_start(struct skynet_config * config);
+/*
+ 取第 id 个 worker 启动以来的忙碌和空闲时间，单位微秒。 id 超出范围时返回 1 。
+*/
+int skynet_worker_stat(int id, uint64_t *busy, uint64_t *idle);
+/*
+ 启动一个独占 worker 线程，返回它的编号，没有空位时返回 -1 。
+*/
+int skynet_worker_exclusive(void);
+/*
+ 用 perf_event 统计所有 worker 线程的 cache miss 。
+ skynet_perf_start 返回打开的计数器个数， 0 表示不可用；skynet_perf_stop 返回期间的总数。
+*/
+int skynet_perf_start(void);
+uint64_t skynet_perf_stop(void);
 
 #endif
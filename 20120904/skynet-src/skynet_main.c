@@ -100,9 +100,26 @@ main(int argc, char *argv[]) {
 	const char *cpath = optstring("lua_cpath","./lualib/?.so");
 	setenv("LUA_CPATH",cpath,1);
 	optstring("luaservice","./service/?.lua");
+	optint("memory_soft",0);
+	optint("memory_hard",0);
+	optstring("memory_policy","refuse");
 
 	config.thread =  optint("thread",8);
+	config.thread_min = optint("thread_min",0);
+	config.schedule = optstring("schedule","global");
+	config.cpu_affinity = optint("cpu_affinity",0);
+	config.numa = optint("numa",0);
+	config.stall_threshold = optint("stall_threshold",5000);
+	config.stall_traceback = optint("stall_traceback",0);
+	optstring("exclusive","");
+	optstring("priority_high","");
+	optstring("priority_low","");
+	config.batch = optint("batch",1);
+	config.handoff = optint("handoff",0);
+	config.timer_tick = optint("timer_tick",10);
+	config.simulate = optint("simulate",0);
 	config.mqueue_size = optint("mqueue",256);
+	config.mqueue_highwater = optint("mqueue_highwater",0);
 	config.module_path = optstring("cpath","./service/?.so");
 	config.logger = optstring("logger",NULL);
 	config.harbor = optint("harbor", 1);
@@ -0,0 +1,218 @@
+#include "skynet.h"
+#include "skynet_malloc.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ 消息数据的分配器。
+ 小块按尺寸分级，每个线程有自己的空闲链表，从 64K 的 slab 中切分。
+ 其他线程释放的块挂到所属线程的 remote 链表上（无锁），由所属线程在空闲链表用尽时收回。
+ 大于最大级别的块直接用 malloc 。
+ slab 和线程的 heap 都不归还，工作线程的生命期和进程相同。
+*/
+
+#define SMALL_CLASS 16
+#define SLAB_SIZE (64 * 1024)
+#define CLASS_MASK 0xf
+
+static const size_t CLASS_SIZE[SMALL_CLASS] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096,
+};
+
+struct skynet_memcount {
+	int64_t live;	// 带 1 的偏置，服务持有这 1 ，归零时释放
+};
+
+// 紧挨在用户数据之前，16 字节保证数据的对齐
+struct block_header {
+	uintptr_t tag;	// 小块为 heap 指针 | size class ，大块为 0
+	struct skynet_memcount * owner;
+};
+
+struct large_header {
+	size_t sz;
+	size_t reserved;
+	struct block_header header;
+};
+
+// 空闲的块复用数据区保存链表指针
+struct free_block {
+	struct free_block * next;
+};
+
+struct thread_heap {
+	struct free_block * remote;
+	struct free_block * freelist[SMALL_CLASS];
+};
+
+static __thread struct thread_heap * H = NULL;
+static __thread struct skynet_memcount * OWNER = NULL;
+
+static struct thread_heap *
+_heap() {
+	void * ptr = NULL;
+	// 对齐到 cache line ， tag 的低 4 位也因此可以存放 size class
+	if (posix_memalign(&ptr, 64, sizeof(struct thread_heap))) {
+		abort();
+	}
+	struct thread_heap * h = ptr;
+	int i;
+	h->remote = NULL;
+	for (i=0;i<SMALL_CLASS;i++) {
+		h->freelist[i] = NULL;
+	}
+	H = h;
+	return h;
+}
+
+static int
+_class(size_t sz) {
+	int i;
+	for (i=0;i<SMALL_CLASS;i++) {
+		if (sz <= CLASS_SIZE[i])
+			return i;
+	}
+	return -1;
+}
+
+// 把其他线程还回来的块全部收回到空闲链表
+static void
+_collect(struct thread_heap * heap) {
+	struct free_block * b = __sync_lock_test_and_set(&heap->remote, NULL);
+	while (b) {
+		struct free_block * next = b->next;
+		struct block_header * h = (struct block_header *)b - 1;
+		int c = h->tag & CLASS_MASK;
+		b->next = heap->freelist[c];
+		heap->freelist[c] = b;
+		b = next;
+	}
+}
+
+static void
+_refill(struct thread_heap * heap, int c) {
+	size_t stride = CLASS_SIZE[c] + sizeof(struct block_header);
+	char * slab = malloc(SLAB_SIZE);
+	int n = SLAB_SIZE / stride;
+	int i;
+	for (i=0;i<n;i++) {
+		struct block_header * h = (struct block_header *)(slab + i * stride);
+		h->tag = (uintptr_t)heap | c;
+		struct free_block * b = (struct free_block *)(h+1);
+		b->next = heap->freelist[c];
+		heap->freelist[c] = b;
+	}
+}
+
+static struct block_header *
+_alloc_small(int c) {
+	struct thread_heap * heap = H;
+	if (heap == NULL) {
+		heap = _heap();
+	}
+	struct free_block * b = heap->freelist[c];
+	if (b == NULL) {
+		_collect(heap);
+		b = heap->freelist[c];
+		if (b == NULL) {
+			_refill(heap, c);
+			b = heap->freelist[c];
+		}
+	}
+	heap->freelist[c] = b->next;
+	return (struct block_header *)b - 1;
+}
+
+static void
+_free_small(struct block_header * h) {
+	struct thread_heap * heap = (struct thread_heap *)(h->tag & ~(uintptr_t)CLASS_MASK);
+	struct free_block * b = (struct free_block *)(h+1);
+	if (heap == H) {
+		int c = h->tag & CLASS_MASK;
+		b->next = heap->freelist[c];
+		heap->freelist[c] = b;
+		return;
+	}
+	for (;;) {
+		struct free_block * head = heap->remote;
+		b->next = head;
+		if (__sync_bool_compare_and_swap(&heap->remote, head, b))
+			return;
+	}
+}
+
+static void
+_memcount_sub(struct skynet_memcount * mc, int64_t sz) {
+	if (__sync_sub_and_fetch(&mc->live, sz) == 0) {
+		free(mc);
+	}
+}
+
+void *
+skynet_malloc(size_t sz) {
+	struct block_header * h;
+	size_t size;
+	int c = _class(sz);
+	if (c < 0) {
+		struct large_header * l = malloc(sizeof(*l) + sz);
+		l->sz = sz;
+		h = &l->header;
+		h->tag = 0;
+		size = sz;
+	} else {
+		h = _alloc_small(c);
+		size = CLASS_SIZE[c];
+	}
+	struct skynet_memcount * owner = OWNER;
+	h->owner = owner;
+	if (owner) {
+		__sync_add_and_fetch(&owner->live, size);
+	}
+	return h+1;
+}
+
+void
+skynet_free(void * ptr) {
+	if (ptr == NULL)
+		return;
+	struct block_header * h = (struct block_header *)ptr - 1;
+	struct skynet_memcount * owner = h->owner;
+	size_t size;
+	if (h->tag == 0) {
+		struct large_header * l = (struct large_header *)((char *)h - offsetof(struct large_header, header));
+		size = l->sz;
+		free(l);
+	} else {
+		size = CLASS_SIZE[h->tag & CLASS_MASK];
+		_free_small(h);
+	}
+	if (owner) {
+		_memcount_sub(owner, size);
+	}
+}
+
+struct skynet_memcount *
+skynet_memcount_new(void) {
+	struct skynet_memcount * mc = malloc(sizeof(*mc));
+	mc->live = 1;
+	return mc;
+}
+
+void
+skynet_memcount_release(struct skynet_memcount * mc) {
+	_memcount_sub(mc, 1);
+}
+
+size_t
+skynet_memcount_live(struct skynet_memcount * mc) {
+	return mc->live - 1;
+}
+
+struct skynet_memcount *
+skynet_memcount_switch(struct skynet_memcount * mc) {
+	struct skynet_memcount * prev = OWNER;
+	OWNER = mc;
+	return prev;
+}
@@ -0,0 +1,20 @@
+#ifndef SKYNET_MALLOC_H
+#define SKYNET_MALLOC_H
+
+#include <stddef.h>
+
+/*
+ 每个服务一个内存计数器，统计由该服务分配、尚未释放的字节数。
+ 计数器由服务和它分配出去的内存块共同持有，服务销毁后，最后一块内存释放时计数器才被回收。
+*/
+struct skynet_memcount;
+
+struct skynet_memcount * skynet_memcount_new(void);
+void skynet_memcount_release(struct skynet_memcount *);
+size_t skynet_memcount_live(struct skynet_memcount *);
+/*
+ 设置当前线程的计数器，之后 skynet_malloc 分配的内存都记在它上面。返回之前的计数器。
+*/
+struct skynet_memcount * skynet_memcount_switch(struct skynet_memcount *);
+
+#endif
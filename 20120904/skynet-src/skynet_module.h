@@ -6,6 +6,7 @@ struct skynet_context;
 typedef void * (*skynet_dl_create)(void);
 typedef int (*skynet_dl_init)(void * inst, struct skynet_context *, const char * parm);
 typedef void (*skynet_dl_release)(void * inst);
+typedef void (*skynet_dl_signal)(void * inst, int signal);
 
 struct skynet_module {
 	const char * name;
@@ -13,6 +14,7 @@ struct skynet_module {
 	skynet_dl_create create;
 	skynet_dl_init init;
 	skynet_dl_release release;
+	skynet_dl_signal signal;	// 可选
 };
 
 /*
@@ -38,6 +40,11 @@ int skynet_module_instance_init(struct skynet_module *, void * inst, struct skyn
  调用 release 接口。
 */
 void skynet_module_instance_release(struct skynet_module *, void *inst);
+/*
+ 调用 signal 接口，通知实例发生了异步事件（比如回调卡住），可能在其他线程中调用。
+ 模块没有实现时什么也不做。
+*/
+void skynet_module_instance_signal(struct skynet_module *, void *inst, int signal);
 
 /*
  初始化 modules
@@ -0,0 +1,74 @@
+#include "skynet_monitor.h"
+#include "skynet_cacheline.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ 只有 worker 自己写，监视线程读。
+ 写的前后各增加一次 version ，奇数表示正在写。
+ 读者在读字段前后比较 version ，正在写或者不一致就放弃这次检查。
+*/
+struct skynet_monitor {
+	int version;
+	int check_version;	// 已经报告过的 version
+	uint32_t source;
+	uint32_t destination;
+	uint64_t since;
+} CACHE_ALIGNED;	// 每个 worker 每条消息都写两次，不能和别的 worker 的 monitor 挤在一个 cache line 上
+
+static uint64_t
+_now() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000;
+}
+
+struct skynet_monitor *
+skynet_monitor_new(void) {
+	struct skynet_monitor * sm = skynet_cacheline_alloc(sizeof(*sm));
+	memset(sm, 0, sizeof(*sm));
+	return sm;
+}
+
+void
+skynet_monitor_delete(struct skynet_monitor *sm) {
+	free(sm);
+}
+
+void
+skynet_monitor_trigger(struct skynet_monitor *sm, uint32_t source, uint32_t destination) {
+	__sync_add_and_fetch(&sm->version, 1);
+	sm->source = source;
+	sm->destination = destination;
+	if (destination) {
+		sm->since = _now();
+	}
+	__sync_synchronize();
+	__sync_add_and_fetch(&sm->version, 1);
+}
+
+uint32_t
+skynet_monitor_check(struct skynet_monitor *sm, uint64_t threshold, uint32_t *source, uint64_t *elapsed) {
+	int version = sm->version;
+	if ((version & 1) || version == sm->check_version) {
+		return 0;
+	}
+	__sync_synchronize();
+	uint32_t destination = sm->destination;
+	uint32_t src = sm->source;
+	uint64_t since = sm->since;
+	__sync_synchronize();
+	if (destination == 0 || version != sm->version) {
+		return 0;
+	}
+	uint64_t now = _now();
+	if (now < since + threshold) {
+		return 0;
+	}
+	sm->check_version = version;
+	*source = src;
+	*elapsed = now - since;
+	return destination;
+}
@@ -0,0 +1,23 @@
+#ifndef SKYNET_MONITOR_H
+#define SKYNET_MONITOR_H
+
+#include <stdint.h>
+
+/*
+ 每个 worker 一个 monitor ，记录它正在处理哪条消息以及从什么时候开始。
+ worker 在回调前后调用 skynet_monitor_trigger ，监视线程定期调用 skynet_monitor_check 。
+*/
+struct skynet_monitor;
+
+struct skynet_monitor * skynet_monitor_new(void);
+void skynet_monitor_delete(struct skynet_monitor *);
+/*
+ destination 为 0 表示回调结束。
+*/
+void skynet_monitor_trigger(struct skynet_monitor *, uint32_t source, uint32_t destination);
+/*
+ 同一条消息处理超过 threshold 微秒时返回目标服务的 handle ，每条消息只返回一次，否则返回 0 。
+*/
+uint32_t skynet_monitor_check(struct skynet_monitor *, uint64_t threshold, uint32_t *source, uint64_t *elapsed);
+
+#endif
@@ -2,43 +2,137 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "skynet_multicast.h"
+#include "skynet_buffer.h"
+#include "skynet_cacheline.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
-#define DEFAULT_QUEUE_SIZE 64;
+struct message_node {
+	struct message_node * next;
+	struct skynet_message message;
+};
 
-// 二级消息队列，和服务挂钩
+/*
+ 二级消息队列，和服务挂钩。
+ 多生产者单消费者的无锁链表队列：生产者用原子交换抢占 tail 后再把前驱的 next 接上，
+ 消费者独占 head 。 head 永远指向一个已经被取走的哨兵节点， head->next 才是下一条消息。
+ 链表按节点增长，不存在整体扩容拷贝。
+ 字段按访问者分成三个 cache line ：很少修改的设置，生产者写的 tail 和双方都原子修改的计数，
+ 只有消费者访问的 head 。
+*/
 struct message_queue {
 	uint32_t handle;
-	int cap;
-	int head;	// 指向当前可以取出消息的位置，由取出操作 skynet_mq_pop 来管理
-	int tail;	// 指向当前可以插入的队列中的位置，由插入操作 skynet_mq_push 来管理
-	int lock;
 	int release;	// 二级消息队列释放标志
-	int in_global;		// 初始置位。置位表示二级消息队列中还有消息，否则表示二级消息队列中消息为空。
-	struct skynet_message *queue;
+	int highwater;	// 0 表示不限制
+	int exclusive;	// 独占的 worker 编号， -1 表示没有
+	int priority;	// MQ_PRIORITY_HIGH NORMAL 或 LOW
+	int node;	// 所属的 NUMA 节点，就绪时放进这个节点的全局队列
+	uint64_t affinity;	// 可以处理它的 worker 集合， 0 表示任意 worker
+	unsigned char * policy;	// 按消息类型的过载策略，第一次设置时才分配
+
+	struct message_node * tail CACHE_ALIGNED;	// 由插入操作 skynet_mq_push 原子交换
+	int in_global;		// 初始置位。置位表示二级消息队列在全局队列中或正在被某个 worker 处理。
+	int length;		// 队列中的消息数，生产者和消费者各自原子增减，只作为参考值
+	size_t bytes;	// 队列中消息数据的字节数，同样只作为参考值
+	int overload;	// 越过高水位时由生产者置位，回落到一半以下时由消费者清除
+	unsigned next;	// 按 affinity 轮流挑选 worker 的游标，由放回全局队列的一方修改
+
+	struct message_node * head CACHE_ALIGNED;	// 由取出操作 skynet_mq_pop 独占
 };
 
-// 全局(一级)消息队列
+/*
+ 全局(一级)消息队列。
+ head 和 tail 都在锁内修改，和锁放在同一个 cache line 上；每个队列独占一个 cache line ，
+ 数组中相邻的队列（不同优先级、不同 worker 的本地队列）互不干扰。
+*/
 struct global_queue {
-	int cap;
+	int lock;
 	int head;	// 指向当前可以取出消息队列的位置，由取出操作 skynet_globalmq_pop 来管理
 	int tail;	// 指向当前可以插入消息队列的位置，由插入操作 skynet_globalmq_push 管理
-	int lock;
+	int cap;
 	struct message_queue ** queue;	// 二维消息数组
-};
+} CACHE_ALIGNED;
+
+// 窃取模式下全局队列之前先检查本地队列的次数，避免全局队列被饿死
+#define STEAL_GLOBAL_INTERVAL 64
+
+/*
+ 每个 worker 的就绪队列。
+ local 是窃取模式下的本地队列，其他 worker 可以窃取；
+ pinned 只放绑定到这个 worker 的二级消息队列，只有它自己取。
+ 编号 WORKER 之后的是独占 worker ，只处理自己的 pinned 队列。
+*/
+struct worker_queue {
+	struct global_queue local;
+	struct global_queue pinned;
+	unsigned tick;
+	int sleep;	// 正在休眠且还没有被叫醒，由 PARK.mutex 保护
+	pthread_cond_t cond;
+} CACHE_ALIGNED;
 
+/*
+ 每个 NUMA 节点的每个优先级一个全局队列，按 Q[node * MQ_PRIORITY_LEVEL + priority] 排列。
+ 普通优先级的队列在窃取模式下放在 worker 的本地队列中，
+ 高低优先级的队列总是放在共享的全局队列中，由所有普通 worker 按权重轮流查看。
+ worker 先处理本节点的队列，本节点没有工作时才去其他节点拿。
+*/
 static struct global_queue *Q = NULL;
+static int NODES = 1;
+static int * NODE = NULL;	// 每个 worker 所在的节点
+static unsigned NODE_NEXT = 0;	// 非 worker 线程创建的队列轮流分配节点
 
-#define LOCK(q) while (__sync_lock_test_and_set(&(q)->lock,1)) {}
+#define GLOBAL(node, priority) (&Q[(node) * MQ_PRIORITY_LEVEL + (priority)])
+static int HIGHWATER = 0;
+static struct worker_queue *W = NULL;
+static int WORKER = 0;	// 普通 worker 数，独占 worker 的编号从这里开始
+static int ACTIVE = 0;	// 参与调度的普通 worker 数，编号在 [ACTIVE, WORKER) 之间的只处理绑定到自己的队列
+static int STEAL = 0;
+static int EXCLUSIVE = 0;	// 已经分配的独占 worker 数
+
+// 空闲 worker 的休眠和唤醒，每个 worker 有自己的条件变量，绑定的队列只叫醒它能去的 worker
+struct worker_park {
+	pthread_mutex_t mutex;
+	int sleep;	// 正在休眠且还没有被叫醒的 worker 数
+};
+
+static struct worker_park PARK = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static __thread int WORKER_ID = -1;	// 当前线程对应的 worker 编号，非 worker 线程为 -1
+
+/*
+ 直接交接：worker 在回调中发消息唤醒了一个空闲的服务时，不把它放进全局队列，
+ 而是记在 HANDOFF 里，当前回调结束后由同一个 worker 接着处理，省掉两次加锁和一次跨核迁移，
+ 消息数据也还在缓存里。连续交接 HANDOFF_LIMIT 次后回到全局队列，避免一条调用链霸占 worker 。
+*/
+static int HANDOFF_LIMIT = 0;
+static __thread struct message_queue * HANDOFF = NULL;
+static __thread int HANDOFF_CHAIN = 0;
+
+// 模拟模式下随机挑选就绪队列的种子， 0 表示按先进先出的顺序
+static uint32_t SEED = 0;
+
+// 抢不到锁时只读等待，不反复抢占 cache line 的所有权
+#define LOCK(q) while (__sync_lock_test_and_set(&(q)->lock,1)) { while (*(volatile int *)&(q)->lock) {} }
 #define UNLOCK(q) __sync_lock_release(&(q)->lock);
 
+static void
+_queue_init(struct global_queue *q, int n) {
+	memset(q,0,sizeof(*q));
+	int cap = 2;
+	while (cap < n) {
+		cap *=2;
+	}
+	
+	q->cap = cap;
+	q->queue = malloc(cap * sizeof(struct message_queue *));
+}
+
 static void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+_queue_push(struct global_queue *q, struct message_queue * queue) {
 	LOCK(q)
 
 	q->queue[q->tail] = queue;
@@ -63,15 +157,35 @@ skynet_globalmq_push(struct message_queue * queue) {
 	UNLOCK(q)
 }
 
-/*
- 从全局消息队列中按照轮训弹出一个二级消息队列。
-*/
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
+// xorshift ，只在模拟模式的单个调度线程中使用
+static uint32_t
+_random(void) {
+	uint32_t x = SEED;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	SEED = x;
+	return x;
+}
+
+static struct message_queue *
+_queue_pop(struct global_queue *q) {
 	struct message_queue * ret = NULL;
+	// 先不加锁看一眼，窃取时扫描空队列不用去抢别人的锁
+	if (q->head == q->tail) {
+		return NULL;
+	}
 	LOCK(q)
 
+	if (SEED && q->head != q->tail) {
+		// 模拟模式：由种子决定取哪一个，换到队首再取出
+		int n = (q->tail - q->head + q->cap) % q->cap;
+		int idx = (q->head + _random() % n) % q->cap;
+		struct message_queue * tmp = q->queue[idx];
+		q->queue[idx] = q->queue[q->head];
+		q->queue[q->head] = tmp;
+	}
+
 	if (q->head != q->tail) {
 		ret = q->queue[q->head];
 		if ( ++ q->head >= q->cap) {
@@ -84,27 +198,463 @@ skynet_globalmq_pop() {
 	return ret;
 }
 
+/*
+ 绑定的二级消息队列应该交给哪个 worker ， -1 表示不绑定。
+ 当前 worker 在集合中时留在当前 worker ，否则在集合中轮流挑选，优先挑选参与调度的 worker 。
+*/
+static int
+_pinned_worker(struct message_queue * queue) {
+	if (queue->exclusive >= 0) {
+		return queue->exclusive;
+	}
+	uint64_t affinity = queue->affinity;
+	if (affinity == 0) {
+		return -1;
+	}
+	int id = WORKER_ID;
+	if (id >= 0 && id < ACTIVE && id < 64 && (affinity & ((uint64_t)1 << id))) {
+		return id;
+	}
+	int limit = WORKER < 64 ? WORKER : 64;
+	int pass, i;
+	for (pass=0;pass<2;pass++) {
+		for (i=0;i<limit;i++) {
+			int n = (queue->next + i) % limit;
+			if ((affinity & ((uint64_t)1 << n)) && (pass || n < ACTIVE)) {
+				queue->next = n + 1;
+				return n;
+			}
+		}
+	}
+	// 集合中没有存在的 worker ，当作不绑定
+	return -1;
+}
+
+/*
+ 叫醒休眠的 worker id ，调用者持有 PARK.mutex 。
+ 由叫醒的一方清掉 sleep 标记，被叫醒的线程拿回锁之前，接下来的 _wakeup 不会再选中它。
+*/
+static void
+_signal(int id) {
+	W[id].sleep = 0;
+	-- PARK.sleep;
+	pthread_cond_signal(&W[id].cond);
+}
+
+/*
+ target 为 -1 时优先叫醒 node 节点上休眠的 worker ，没有再叫醒其他节点的。
+*/
+static void
+_wakeup(int target, int node) {
+	// 和 skynet_mq_park 中先增加 sleep 再检查队列的顺序相对，两边至少有一方能看到对方
+	__sync_synchronize();
+	if (PARK.sleep == 0) {
+		return;
+	}
+	pthread_mutex_lock(&PARK.mutex);
+	if (target < 0) {
+		int i;
+		for (i=0;i<ACTIVE;i++) {
+			if (W[i].sleep) {
+				if (NODE[i] == node) {
+					target = i;
+					break;
+				}
+				if (target < 0) {
+					target = i;
+				}
+			}
+		}
+	}
+	if (target >= 0 && W[target].sleep) {
+		_signal(target);
+	}
+	pthread_mutex_unlock(&PARK.mutex);
+}
+
+/*
+ 绑定的二级消息队列放进目标 worker 的 pinned 队列。
+ 窃取模式下同一节点的普通 worker 线程把就绪的二级消息队列放进自己的本地队列，
+ 其他情况放进队列所属节点的全局队列。
+*/
+static void 
+skynet_globalmq_push(struct message_queue * queue) {
+	int target = _pinned_worker(queue);
+	int node = queue->node;
+	int id = WORKER_ID;
+	if (target >= 0) {
+		_queue_push(&W[target].pinned, queue);
+	} else if (queue->priority != MQ_PRIORITY_NORMAL) {
+		_queue_push(GLOBAL(node, queue->priority), queue);
+	} else if (STEAL && id >= 0 && id < ACTIVE && NODE[id] == node) {
+		_queue_push(&W[id].local, queue);
+	} else {
+		_queue_push(GLOBAL(node, MQ_PRIORITY_NORMAL), queue);
+	}
+	_wakeup(target, node);
+}
+
+static int
+_empty(int id) {
+	struct global_queue * q = &W[id].pinned;
+	if (q->head != q->tail) {
+		return 0;
+	}
+	if (id >= ACTIVE) {
+		return 1;
+	}
+	int i;
+	for (i=0;i<NODES * MQ_PRIORITY_LEVEL;i++) {
+		if (Q[i].head != Q[i].tail) {
+			return 0;
+		}
+	}
+	if (STEAL) {
+		for (i=0;i<WORKER;i++) {
+			q = &W[i].local;
+			if (q->head != q->tail) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ worker 空闲时休眠，直到有它能处理的二级消息队列就绪。
+*/
+void
+skynet_mq_park(void) {
+	int id = WORKER_ID;
+	assert(id >= 0);
+	struct worker_queue * w = &W[id];
+	pthread_mutex_lock(&PARK.mutex);
+	++ PARK.sleep;
+	w->sleep = 1;
+	__sync_synchronize();
+	if (_empty(id)) {
+		pthread_cond_wait(&w->cond, &PARK.mutex);
+	}
+	// 被 _signal 叫醒时标记已经清掉了，没有休眠或者虚假唤醒时自己清
+	if (w->sleep) {
+		w->sleep = 0;
+		-- PARK.sleep;
+	}
+	pthread_mutex_unlock(&PARK.mutex);
+}
+
+int
+skynet_mq_parked(void) {
+	return PARK.sleep;
+}
+
+/*
+ local 不为 0 时只从同一节点的 worker 窃取，否则只从其他节点的 worker 窃取。
+*/
+static struct message_queue *
+_steal(int id, int local) {
+	int i;
+	for (i=1;i<WORKER;i++) {
+		int victim = (id + i) % WORKER;
+		if ((NODE[victim] == NODE[id]) != local) {
+			continue;
+		}
+		struct message_queue * ret = _queue_pop(&W[victim].local);
+		if (ret) {
+			return ret;
+		}
+	}
+	return NULL;
+}
+
+/*
+ 普通优先级：窃取模式下依次尝试本地队列、本节点的全局队列、本节点其他 worker 的本地队列，
+ 每 STEAL_GLOBAL_INTERVAL 轮先看一次全局队列。
+*/
+static struct message_queue *
+_pop_normal(int id, struct worker_queue *w) {
+	struct global_queue * global = GLOBAL(NODE[id], MQ_PRIORITY_NORMAL);
+	if (!STEAL) {
+		return _queue_pop(global);
+	}
+	struct message_queue * ret;
+	if ((w->tick % STEAL_GLOBAL_INTERVAL) == 0) {
+		ret = _queue_pop(global);
+		if (ret) {
+			return ret;
+		}
+	}
+	ret = _queue_pop(&w->local);
+	if (ret) {
+		return ret;
+	}
+	ret = _queue_pop(global);
+	if (ret) {
+		return ret;
+	}
+	return _steal(id, 1);
+}
+
+static struct message_queue *
+_pop_priority(int id, struct worker_queue *w, int priority) {
+	if (priority == MQ_PRIORITY_NORMAL) {
+		return _pop_normal(id, w);
+	}
+	return _queue_pop(GLOBAL(NODE[id], priority));
+}
+
+// 本节点没有工作时，按优先级从其他节点的全局队列和 worker 本地队列中拿
+static struct message_queue *
+_pop_remote(int id) {
+	int node = NODE[id];
+	int i, p;
+	for (i=1;i<NODES;i++) {
+		int n = (node + i) % NODES;
+		for (p=0;p<MQ_PRIORITY_LEVEL;p++) {
+			struct message_queue * ret = _queue_pop(GLOBAL(n, p));
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+	if (STEAL && NODES > 1) {
+		return _steal(id, 0);
+	}
+	return NULL;
+}
+
+/*
+ 加权轮转：每 PRIORITY_ROUND 轮中，高优先级先被查看 PRIORITY_HIGH_WEIGHT 轮，
+ 普通优先级 PRIORITY_NORMAL_WEIGHT 轮，剩下的轮次先看低优先级。
+ 先看的级别为空时按优先级顺序查看其他级别，所以空闲时不会浪费机会，
+ 繁忙时低优先级也能保证拿到一定比例，不会被饿死。
+*/
+#define PRIORITY_HIGH_WEIGHT 8
+#define PRIORITY_NORMAL_WEIGHT 4
+#define PRIORITY_ROUND 13
+
+static int
+_first_priority(unsigned tick) {
+	unsigned n = tick % PRIORITY_ROUND;
+	if (n < PRIORITY_HIGH_WEIGHT) {
+		return MQ_PRIORITY_HIGH;
+	}
+	if (n < PRIORITY_HIGH_WEIGHT + PRIORITY_NORMAL_WEIGHT) {
+		return MQ_PRIORITY_NORMAL;
+	}
+	return MQ_PRIORITY_LOW;
+}
+
+/*
+ 从全局消息队列中按照轮训弹出一个二级消息队列。
+ worker 隔一轮先看一次绑定到自己的队列，避免绑定的热点服务饿死其他服务。
+ 其余按优先级加权轮转。
+ 独占 worker 只处理绑定到自己的队列。
+*/
+struct message_queue * 
+skynet_globalmq_pop() {
+	int id = WORKER_ID;
+	struct message_queue * ret = HANDOFF;
+	int i;
+	if (ret) {
+		HANDOFF = NULL;
+		++ HANDOFF_CHAIN;
+		return ret;
+	}
+	HANDOFF_CHAIN = 0;
+	if (id < 0) {
+		for (i=0;i<NODES * MQ_PRIORITY_LEVEL;i++) {
+			ret = _queue_pop(&Q[i]);
+			if (ret) {
+				return ret;
+			}
+		}
+		return NULL;
+	}
+	struct worker_queue * w = &W[id];
+	if (id >= ACTIVE) {
+		return _queue_pop(&w->pinned);
+	}
+	++ w->tick;
+	if (w->tick & 1) {
+		ret = _queue_pop(&w->pinned);
+		if (ret) {
+			return ret;
+		}
+	}
+	int first = _first_priority(w->tick);
+	ret = _pop_priority(id, w, first);
+	if (ret) {
+		return ret;
+	}
+	for (i=0;i<MQ_PRIORITY_LEVEL;i++) {
+		if (i != first) {
+			ret = _pop_priority(id, w, i);
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+	ret = _queue_pop(&w->pinned);
+	if (ret) {
+		return ret;
+	}
+	return _pop_remote(id);
+}
+
+void
+skynet_mq_worker(int id) {
+	assert(id >= 0 && id < WORKER + MQ_MAX_EXCLUSIVE);
+	WORKER_ID = id;
+}
+
+int
+skynet_mq_exclusive(void) {
+	for (;;) {
+		int n = EXCLUSIVE;
+		if (n >= MQ_MAX_EXCLUSIVE) {
+			return -1;
+		}
+		if (__sync_bool_compare_and_swap(&EXCLUSIVE, n, n+1)) {
+			return WORKER + n;
+		}
+	}
+}
+
+/*
+ 绑定后队列归属到绑定的 worker 所在的节点（绑定到多个节点时取第一个 worker 的节点），
+ 解除绑定时保持原来的节点。
+*/
+void
+skynet_mq_affinity(struct message_queue *q, uint64_t affinity, int exclusive) {
+	if (exclusive >= 0) {
+		q->node = NODE[exclusive];
+	} else if (affinity) {
+		int i;
+		for (i=0;i<WORKER && i<64;i++) {
+			if (affinity & ((uint64_t)1 << i)) {
+				q->node = NODE[i];
+				break;
+			}
+		}
+	}
+	q->affinity = affinity;
+	q->exclusive = exclusive;
+}
+
+void
+skynet_mq_simulate(uint32_t seed) {
+	SEED = seed;
+}
+
+void
+skynet_mq_handoff(int limit) {
+	HANDOFF_LIMIT = limit < 0 ? 0 : limit;
+}
+
+int
+skynet_mq_nodes(void) {
+	return NODES;
+}
+
+int
+skynet_mq_worker_node(int id) {
+	if (id < 0 || id >= WORKER) {
+		return -1;
+	}
+	return NODE[id];
+}
+
+/*
+ 调整参与调度的普通 worker 数。
+ 减少时多出来的 worker 处理完手上的队列后只看绑定到自己的队列，没有就一直休眠；
+ 它本地队列中剩下的二级消息队列会被其他 worker 窃取。
+ 增加时叫醒新加入的 worker 。
+*/
+void
+skynet_mq_active(int n) {
+	if (n < 1) {
+		n = 1;
+	} else if (n > WORKER) {
+		n = WORKER;
+	}
+	pthread_mutex_lock(&PARK.mutex);
+	int old = ACTIVE;
+	ACTIVE = n;
+	int i;
+	for (i=old;i<n;i++) {
+		if (W[i].sleep) {
+			_signal(i);
+		}
+	}
+	pthread_mutex_unlock(&PARK.mutex);
+}
+
+/*
+ 就绪（等待 worker 处理）的二级消息队列数，不加锁读取，只是近似值。
+*/
+int
+skynet_mq_ready(void) {
+	int n = 0;
+	int i;
+	for (i=0;i<NODES * MQ_PRIORITY_LEVEL;i++) {
+		struct global_queue * q = &Q[i];
+		int cap = q->cap;
+		n += (q->tail - q->head + cap) % cap;
+	}
+	if (STEAL) {
+		for (i=0;i<WORKER;i++) {
+			struct global_queue * q = &W[i].local;
+			int cap = q->cap;
+			n += (q->tail - q->head + cap) % cap;
+		}
+	}
+	return n;
+}
+
+void
+skynet_mq_priority(struct message_queue *q, int priority) {
+	assert(priority >= 0 && priority < MQ_PRIORITY_LEVEL);
+	q->priority = priority;
+}
+
 /*
  创建二级消息队列
 */
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
-	struct message_queue *q = malloc(sizeof(*q));
+	struct message_queue *q = skynet_cacheline_alloc(sizeof(*q));
+	struct message_node *stub = malloc(sizeof(*stub));
+	stub->next = NULL;
 	q->handle = handle;
-	q->cap = DEFAULT_QUEUE_SIZE;
-	q->head = 0;
-	q->tail = 0;
-	q->lock = 0;
 	q->in_global = 1;
 	q->release = 0;
-	q->queue = malloc(sizeof(struct skynet_message) * q->cap);
+	q->length = 0;
+	q->bytes = 0;
+	q->highwater = HIGHWATER;
+	q->overload = 0;
+	q->policy = NULL;
+	q->affinity = 0;
+	q->exclusive = -1;
+	q->priority = MQ_PRIORITY_NORMAL;
+	// 和创建它的 worker 在同一个节点上，队列和服务的内存也是在这个节点上首次访问的
+	if (WORKER_ID >= 0) {
+		q->node = NODE[WORKER_ID];
+	} else {
+		q->node = __sync_fetch_and_add(&NODE_NEXT, 1) % NODES;
+	}
+	q->next = 0;
+	q->head = stub;
+	q->tail = stub;
 
 	return q;
 }
 
 static void 
 _release(struct message_queue *q) {
-	free(q->queue);
+	assert(q->head->next == NULL);
+	free(q->head);
+	free(q->policy);
 	free(q);
 }
 
@@ -116,83 +666,175 @@ skynet_mq_handle(struct message_queue *q) {
 	return q->handle;
 }
 
+/*
+ 返回二级消息队列中的消息数
+*/
+int
+skynet_mq_length(struct message_queue *q) {
+	return q->length;
+}
+
+/*
+ 返回二级消息队列中消息数据的总字节数
+*/
+size_t
+skynet_mq_bytes(struct message_queue *q) {
+	return q->bytes;
+}
+
+void
+skynet_mq_highwater(struct message_queue *q, int highwater) {
+	q->highwater = highwater;
+}
+
+/*
+ 只由队列的所有者调用，生产者可能同时在读，所以表先填好再发布。
+*/
+void
+skynet_mq_policy(struct message_queue *q, int type, int policy) {
+	if (q->policy == NULL) {
+		unsigned char * p = malloc(256);
+		memset(p, MQ_ACCEPT, 256);
+		__sync_synchronize();
+		q->policy = p;
+	}
+	q->policy[type & 0xff] = policy;
+}
+
+int
+skynet_mq_admit(struct message_queue *q, int type) {
+	int highwater = q->highwater;
+	if (highwater <= 0 || q->length < highwater) {
+		return MQ_ACCEPT;
+	}
+	unsigned char * policy = q->policy;
+	if (policy && policy[type & 0xff] != MQ_ACCEPT) {
+		return policy[type & 0xff];
+	}
+	if (q->overload == 0 && __sync_bool_compare_and_swap(&q->overload, 0, 1)) {
+		return MQ_OVERLOAD;
+	}
+	return MQ_ACCEPT;
+}
+
 /*
  从二级消息队列中轮询弹出一个消息，返回 0 表示取到消息。
+ 队列为空时清除 in_global 。为了不和正在插入的生产者错过，清除之后要再检查一次：
+ 如果这时有新消息，并且能重新抢回 in_global ，就继续处理；抢不回说明生产者已经把队列放回全局队列，
+ 当前 worker 必须放手。
 */
 int
 skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;
-	LOCK(q)
+	struct message_node * head = q->head;
+	struct message_node * next = head->next;
 
-	if (q->head != q->tail) {
-		*message = q->queue[q->head];
-		ret = 0;
-		if ( ++ q->head >= q->cap) {
-			q->head = 0;
+	if (next == NULL) {
+		q->in_global = 0;
+		__sync_synchronize();
+		next = head->next;
+		if (next == NULL || !__sync_bool_compare_and_swap(&q->in_global, 0, 1)) {
+			return 1;
 		}
 	}
 
-	if (ret) {
-		q->in_global = 0;
+	*message = next->message;
+	q->head = next;
+	free(head);
+	__sync_sub_and_fetch(&q->length, 1);
+	__sync_sub_and_fetch(&q->bytes, message->sz & HANDLE_MASK);
+	if (q->overload && q->length <= q->highwater / 2) {
+		q->overload = 0;
 	}
-	
-	UNLOCK(q)
 
-	return ret;
+	return 0;
 }
 
 /*
- 往二级消息队列中添加一个消息
+ 能否把刚变成就绪的队列直接交给当前 worker 。只在参与调度的普通 worker 上交接，
+ 绑定到其他 worker 、属于其他节点或者是低优先级的队列照常放回全局队列。
+*/
+static int
+_handoff(struct message_queue *q) {
+	int id = WORKER_ID;
+	if (HANDOFF || HANDOFF_CHAIN >= HANDOFF_LIMIT || id < 0 || id >= ACTIVE) {
+		return 0;
+	}
+	if (q->exclusive >= 0 || q->priority == MQ_PRIORITY_LOW || q->node != NODE[id]) {
+		return 0;
+	}
+	if (q->affinity && (id >= 64 || (q->affinity & ((uint64_t)1 << id)) == 0)) {
+		return 0;
+	}
+	HANDOFF = q;
+	return 1;
+}
+
+/*
+ 往二级消息队列中添加一个消息。
+ 插入之后如果 in_global 为 0 ，由抢到置位的那个生产者负责放回全局队列，
+ 或者交接给当前 worker 。
 */
 void 
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
-	LOCK(q)
-
 	if (message) {
-		q->queue[q->tail] = *message;
-		if (++ q->tail >= q->cap) {
-			q->tail = 0;
-		}
-
-		if (q->head == q->tail) {
-			struct skynet_message *new_queue = malloc(sizeof(struct skynet_message) * q->cap * 2);
-			int i;
-			for (i=0;i<q->cap;i++) {
-				new_queue[i] = q->queue[(q->head + i) % q->cap];
-			}
-			q->head = 0;
-			q->tail = q->cap;
-			q->cap *= 2;
-			
-			free(q->queue);
-			q->queue = new_queue;
-		}
+		struct message_node * node = malloc(sizeof(*node));
+		node->next = NULL;
+		node->message = *message;
+		__sync_add_and_fetch(&q->length, 1);
+		__sync_add_and_fetch(&q->bytes, message->sz & HANDLE_MASK);
+		struct message_node * prev = __sync_lock_test_and_set(&q->tail, node);
+		__sync_synchronize();
+		prev->next = node;
 	}
 
-	if (q->in_global == 0) {
-		q->in_global = 1;
-		skynet_globalmq_push(q);
+	// 队列已经在调度中时不必发起 CAS ，减少对这个 cache line 的独占请求
+	if (q->in_global == 0 && __sync_bool_compare_and_swap(&q->in_global, 0, 1)) {
+		if (!_handoff(q)) {
+			skynet_globalmq_push(q);
+		}
 	}
-	
-	UNLOCK(q)
 }
 
 /*
  初始化全局消息队列。
  假设二级消息队列的个数为 X ，则 n <= X <= 2 ^ m
+ steal 不为 0 时开启窃取模式，每个 worker 拥有自己的就绪队列。
+ 另外预留 MQ_MAX_EXCLUSIVE 个独占 worker 的位置。
+ highwater 是新建的二级消息队列的默认高水位。
+ node 是每个 worker （包括独占 worker ）所在的 NUMA 节点，为 NULL 时都在节点 0 上。
 */
 void 
-skynet_mq_init(int n) {
-	struct global_queue *q = malloc(sizeof(*q));
-	memset(q,0,sizeof(*q));
-	int cap = 2;
-	while (cap < n) {
-		cap *=2;
+skynet_mq_init(int n, int worker, int steal, int highwater, int nodes, const int *node) {
+	HIGHWATER = highwater;
+	if (nodes < 1) {
+		nodes = 1;
+	}
+	NODES = nodes;
+	int total = worker + MQ_MAX_EXCLUSIVE;
+	NODE = malloc(total * sizeof(int));
+	int i;
+	for (i=0;i<total;i++) {
+		NODE[i] = node ? node[i] : 0;
+	}
+
+	struct global_queue *q = skynet_cacheline_alloc(nodes * MQ_PRIORITY_LEVEL * sizeof(*q));
+	for (i=0;i<nodes * MQ_PRIORITY_LEVEL;i++) {
+		_queue_init(&q[i], i % MQ_PRIORITY_LEVEL == MQ_PRIORITY_NORMAL ? n / nodes : 2);
 	}
-	
-	q->cap = cap;
-	q->queue = malloc(cap * sizeof(struct skynet_message*));
 	Q=q;
+
+	struct worker_queue * w = skynet_cacheline_alloc(total * sizeof(*w));
+	for (i=0;i<total;i++) {
+		_queue_init(&w[i].local, i < worker && steal ? n / worker : 2);
+		_queue_init(&w[i].pinned, 2);
+		w[i].tick = 0;
+		w[i].sleep = 0;
+		pthread_cond_init(&w[i].cond, NULL);
+	}
+	WORKER = worker;
+	ACTIVE = worker;
+	STEAL = steal;
+	W = w;
 }
 
 void 
@@ -223,7 +865,7 @@ _drop_queue(struct message_queue *q) {
 			assert(msg.sz == 0);
 			skynet_multicast_dispatch((struct skynet_multicast_message *)msg.data, NULL, NULL);
 		} else {
-			free(msg.data);
+			skynet_buffer_free(msg.data, msg.sz);
 		}
 	}
 	_release(q);
@@ -238,14 +880,11 @@ _drop_queue(struct message_queue *q) {
 int 
 skynet_mq_release(struct message_queue *q) {
 	int ret = 0;
-	LOCK(q)
 	
 	if (q->release) {
-		UNLOCK(q)
 		ret = _drop_queue(q);
 	} else {
 		skynet_mq_force_push(q);
-		UNLOCK(q)
 	}
 	
 	return ret;
@@ -9,6 +9,8 @@ struct skynet_message {
 	int session;
 	void * data;
 	size_t sz;
+	uint32_t trace;	// 追踪 id ， 0 表示不追踪
+	uint32_t stamp;	// 带追踪 id 时是入队时间
 };
 
 struct message_queue;
@@ -36,6 +38,34 @@ int skynet_mq_release(struct message_queue *q);
  返回二级消息队列对应的 handle id
 */
 uint32_t skynet_mq_handle(struct message_queue *);
+/*
+ 返回二级消息队列中的消息数，并发读写时只是一个近似值
+*/
+int skynet_mq_length(struct message_queue *);
+/*
+ 返回二级消息队列中消息数据的总字节数，同样是近似值
+*/
+size_t skynet_mq_bytes(struct message_queue *);
+
+// 超过高水位时对某类消息的处理策略，也是 skynet_mq_admit 的返回值
+#define MQ_ACCEPT 0
+#define MQ_OVERLOAD 1	// 接受，并且队列刚刚超过高水位，需要发出过载通知
+#define MQ_DROP 2
+#define MQ_REJECT 3
+
+/*
+ 设置二级消息队列的高水位， 0 表示不限制。
+*/
+void skynet_mq_highwater(struct message_queue *q, int highwater);
+/*
+ 设置队列超过高水位后对 type 类消息的策略： MQ_ACCEPT MQ_DROP 或 MQ_REJECT 。
+*/
+void skynet_mq_policy(struct message_queue *q, int type, int policy);
+/*
+ 决定一条 type 类的消息能否进入队列。
+ 队列长度越过高水位后，第一个被接受的消息返回 MQ_OVERLOAD ，直到队列回落到高水位的一半以下。
+*/
+int skynet_mq_admit(struct message_queue *q, int type);
 
 // 0 for success
 /*
@@ -53,10 +83,70 @@ void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 */
 void skynet_mq_force_push(struct message_queue *q);
 
+// 独占 worker 的最大数量
+#define MQ_MAX_EXCLUSIVE 16
+
 /*
  初始化全局消息队列。
  假设二级消息队列的个数为 X ，则 n <= X <= 2 ^ m
+ steal 不为 0 时开启窃取模式，每个 worker 拥有自己的就绪队列，空闲时从别的 worker 偷取。
+ nodes 是 NUMA 节点数， node[id] 是第 id 个 worker 所在的节点（包括随后的 MQ_MAX_EXCLUSIVE 个独占 worker ），
+ node 为 NULL 表示只有一个节点。每个节点有自己的全局队列， worker 只在本节点没有工作时才去其他节点拿。
+*/
+void skynet_mq_init(int cap, int worker, int steal, int highwater, int nodes, const int *node);
+/*
+ NUMA 节点数，以及第 id 个普通 worker 所在的节点， id 超出范围时返回 -1 。
+*/
+int skynet_mq_nodes(void);
+int skynet_mq_worker_node(int id);
+/*
+ 标记当前线程是第 id 个 worker ，由每个 worker 线程启动时调用。
+*/
+void skynet_mq_worker(int id);
+// 服务的调度优先级，高优先级的队列优先被 worker 取出，低优先级保证不被饿死
+#define MQ_PRIORITY_HIGH 0
+#define MQ_PRIORITY_NORMAL 1
+#define MQ_PRIORITY_LOW 2
+#define MQ_PRIORITY_LEVEL 3
+
+/*
+ 设置二级消息队列的优先级，下一次放回全局队列时生效。
+ 绑定了 worker 的队列不受优先级影响。
+*/
+void skynet_mq_priority(struct message_queue *q, int priority);
+/*
+ 调整参与调度的普通 worker 数，范围是 [1, worker] ，初始为全部。
+*/
+void skynet_mq_active(int n);
+/*
+ 就绪（等待 worker 处理）的二级消息队列数，近似值。
+*/
+int skynet_mq_ready(void);
+/*
+ worker 在回调中唤醒的空闲服务由它自己接着处理，最多连续交接 limit 次， 0 表示关闭。
+*/
+void skynet_mq_handoff(int limit);
+/*
+ 模拟模式：只有一个调度线程，从就绪队列中按 seed 决定的伪随机顺序挑选，同一个 seed 的顺序可以重现。
+*/
+void skynet_mq_simulate(uint32_t seed);
+/*
+ 分配一个独占 worker 的编号，用完时返回 -1 。
+*/
+int skynet_mq_exclusive(void);
+/*
+ 把二级消息队列绑定到 affinity 中的 worker （第 n 位表示第 n 个 worker ，只支持前 64 个），
+ 或者 exclusive 指定的独占 worker 。 affinity 为 0 并且 exclusive 为 -1 表示不绑定。
+ 下一次放回全局队列时生效。
+*/
+void skynet_mq_affinity(struct message_queue *q, uint64_t affinity, int exclusive);
+/*
+ worker 空闲时调用，休眠到有新的二级消息队列就绪为止。
+*/
+void skynet_mq_park(void);
+/*
+ 返回当前休眠（还没有被叫醒）的 worker 数
 */
-void skynet_mq_init(int cap);
+int skynet_mq_parked(void);
 
 #endif
@@ -2,6 +2,7 @@
 #include "skynet_multicast.h"
 #include "skynet_server.h"
 #include "skynet_handle.h"
+#include "skynet_buffer.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -35,7 +36,8 @@ skynet_multicast_dispatch(struct skynet_multicast_message * msg, void * ud, skyn
 	}
 	int ref = __sync_sub_and_fetch(&msg->ref, 1);	// 将 mc->ref 减 1 ，返回 mc->ref 修改之后的值
 	if (ref == 0) {
-		free((void *)msg->msg);
+		// sz 中带有 MESSAGE_TYPE_SHARED 时 msg 是共享 buffer
+		skynet_buffer_free((void *)msg->msg, msg->sz);
 		free(msg);
 	}
 }
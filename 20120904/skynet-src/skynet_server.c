@@ -8,11 +8,19 @@
 #include "skynet.h"
 #include "skynet_multicast.h"
 #include "skynet_group.h"
+#include "skynet_epoch.h"
+#include "skynet_buffer.h"
+#include "skynet_malloc.h"
+#include "skynet_trace.h"
+#include "skynet_monitor.h"
+#include "skynet_imp.h"
+#include "skynet_cacheline.h"
 
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #ifdef CALLING_CHECK
 
@@ -30,20 +38,43 @@
 
 #endif
 
+// 统计只由正在处理该服务的 worker 或服务自己写入，读取时是近似值
+struct context_stat {
+	uint64_t message;	// 处理的消息数
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t cpu;	// 回调中花费的时间，纳秒
+	uint64_t drop;	// 被过载策略丢弃或拒绝的消息数
+	uint64_t stall;	// 回调超过 stall_threshold 的次数
+	int mqlen_max;
+};
+
+/*
+ 按访问方式分成几个 cache line ：
+ ref 每次有人给它发消息都会被 skynet_handle_grab 和 skynet_context_release 原子修改，单独一行；
+ 发送方和 worker 只读的字段一行；只有正在处理它的 worker 写的字段一行；其余是很少访问的冷数据。
+*/
 struct skynet_context {
-	void * instance;
-	struct skynet_module * mod;
-	uint32_t handle;
 	int ref;
-	char result[32];
-	void * cb_ud;
+
+	uint32_t handle CACHE_ALIGNED;
+	struct message_queue *queue;
+	void * instance;
 	skynet_cb cb;
+	void * cb_ud;
+	struct skynet_memcount *mem;
+	int retired;	// 已从 handle 表中摘除，不再处理新消息
+
+	struct context_stat stat CACHE_ALIGNED;
 	int session_id;
-	int init;
 	uint32_t forward;
-	struct message_queue *queue;
-
 	CHECKCALLING_DECL
+
+	struct skynet_module * mod CACHE_ALIGNED;
+	int init;
+	int overload_notify;	// 调用过 MQLIMIT MQPOLICY 或 MQNOTIFY 的服务才会收到过载通知
+	size_t heap;	// 模块通过 skynet_memory_report 报告的内存
+	char result[128];
 };
 
 static void
@@ -57,6 +88,97 @@ _id_to_hex(char * str, uint32_t id) {
 	str[9] = '\0';
 }
 
+/*
+ 解析绑定参数： "exclusive" 分配一个独占 worker ， "any" 解除绑定，
+ "node:N" 绑定到 NUMA 节点 N 上的所有 worker ，否则是逗号分隔的 worker 编号列表。出错返回 1 。
+*/
+static int
+_parse_affinity(const char * str, uint64_t *affinity, int *exclusive) {
+	*affinity = 0;
+	*exclusive = -1;
+	if (strcmp(str, "exclusive") == 0) {
+		*exclusive = skynet_worker_exclusive();
+		return *exclusive < 0;
+	}
+	if (strcmp(str, "any") == 0) {
+		return 0;
+	}
+	if (strncmp(str, "node:", 5) == 0) {
+		int node = strtol(str+5, NULL, 10);
+		int i;
+		for (i=0;i<64 && skynet_mq_worker_node(i) >= 0;i++) {
+			if (skynet_mq_worker_node(i) == node) {
+				*affinity |= (uint64_t)1 << i;
+			}
+		}
+		return *affinity == 0;
+	}
+	while (*str) {
+		char * end = NULL;
+		long id = strtol(str, &end, 10);
+		if (end == str || id < 0 || id >= 64) {
+			return 1;
+		}
+		*affinity |= (uint64_t)1 << id;
+		str = end;
+		if (*str == ',') {
+			++str;
+		}
+	}
+	return *affinity == 0;
+}
+
+/*
+ 解析命令开头可选的 :handle 或 .name 地址，后面用空格和其余参数隔开。
+ 没有地址（包括 *param 为 NULL ）时返回 self ；有地址时返回它对应的 handle ，
+ 并把 *param 移到其余参数，没有其余参数时指向空串。名字不存在时返回 0 。
+*/
+static uint32_t
+_target_handle(uint32_t self, const char ** param) {
+	const char * p = *param;
+	if (p == NULL || (p[0] != ':' && p[0] != '.')) {
+		return self;
+	}
+	const char * arg = strchr(p, ' ');
+	if (arg == NULL) {
+		arg = p + strlen(p);
+	}
+	uint32_t handle;
+	if (p[0] == ':') {
+		handle = strtoul(p+1, NULL, 16);
+	} else {
+		size_t sz = arg - p - 1;
+		char name[sz+1];
+		memcpy(name, p+1, sz);
+		name[sz] = '\0';
+		handle = skynet_handle_findname(name);
+	}
+	*param = arg[0] ? arg + 1 : arg;
+	return handle;
+}
+
+// 模块名是否出现在配置项 key 的列表（逗号分隔）中
+static int
+_module_listed(const char * key, const char * name) {
+	const char * list = skynet_getenv(key);
+	if (list == NULL) {
+		return 0;
+	}
+	size_t sz = strlen(name);
+	while (*list) {
+		const char * end = strchr(list, ',');
+		size_t n = end ? end - list : strlen(list);
+		if (n == sz && memcmp(list, name, sz) == 0) {
+			return 1;
+		}
+		if (end == NULL) {
+			break;
+		}
+		list = end + 1;
+	}
+	return 0;
+}
+
 struct skynet_context * 
 skynet_context_new(const char * name, const char *param) {
 	struct skynet_module * mod = skynet_module_query(name);
@@ -67,7 +189,7 @@ skynet_context_new(const char * name, const char *param) {
 	void *inst = skynet_module_instance_create(mod);
 	if (inst == NULL)
 		return NULL;
-	struct skynet_context * ctx = malloc(sizeof(*ctx));
+	struct skynet_context * ctx = skynet_cacheline_alloc(sizeof(*ctx));
 	CHECKCALLING_INIT(ctx)
 
 	ctx->mod = mod;
@@ -79,18 +201,39 @@ skynet_context_new(const char * name, const char *param) {
 
 	ctx->forward = 0;
 	ctx->init = 0;
+	ctx->mem = skynet_memcount_new();
+	ctx->heap = 0;
+	ctx->retired = 0;
+	ctx->overload_notify = 0;
+	memset(&ctx->stat, 0, sizeof(ctx->stat));
 	ctx->handle = skynet_handle_register(ctx);
 	struct message_queue * queue = ctx->queue = skynet_mq_create(ctx->handle);
 	// init function maybe use ctx->handle, so it must init at last
 
 	CHECKCALLING_BEGIN(ctx)
+	struct skynet_memcount * mem = skynet_memcount_switch(ctx->mem);
 	int r = skynet_module_instance_init(mod, inst, ctx, param);
+	skynet_memcount_switch(mem);
 	CHECKCALLING_END(ctx)
 	if (r == 0) {
 		struct skynet_context * ret = skynet_context_release(ctx);
 		if (ret) {
 			ctx->init = 1;
 		}
+		// 配置项 exclusive 中的模块各自分配一个独占 worker
+		if (_module_listed("exclusive", name)) {
+			int id = skynet_worker_exclusive();
+			if (id < 0) {
+				skynet_error(ctx, "No more exclusive worker for %s", name);
+			} else {
+				skynet_mq_affinity(queue, 0, id);
+			}
+		}
+		if (_module_listed("priority_high", name)) {
+			skynet_mq_priority(queue, MQ_PRIORITY_HIGH);
+		} else if (_module_listed("priority_low", name)) {
+			skynet_mq_priority(queue, MQ_PRIORITY_LOW);
+		}
 		skynet_mq_force_push(queue);
 		return ret;
 	} else {
@@ -114,11 +257,27 @@ skynet_context_grab(struct skynet_context *ctx) {
 	__sync_add_and_fetch(&ctx->ref,1);
 }
 
+/*
+ 引用计数不为 0 时递增并返回 ctx ，否则返回 NULL 。
+*/
+struct skynet_context *
+skynet_context_trygrab(struct skynet_context *ctx) {
+	for (;;) {
+		int ref = ctx->ref;
+		if (ref == 0)
+			return NULL;
+		if (__sync_bool_compare_and_swap(&ctx->ref, ref, ref+1))
+			return ctx;
+	}
+}
+
 static void 
 _delete_context(struct skynet_context *ctx) {
 	skynet_module_instance_release(ctx->mod, ctx->instance);
 	skynet_mq_mark_release(ctx->queue);
-	free(ctx);
+	skynet_memcount_release(ctx->mem);
+	// skynet_handle_grab 无锁读取 ctx ，需要等读者离开后再释放
+	skynet_epoch_retire(ctx);
 }
 
 /*
@@ -138,6 +297,65 @@ skynet_context_ref(struct skynet_context *ctx) {
 	return ctx->ref;
 }
 
+/*
+ ctx 分配的消息数据中尚未释放的字节数
+*/
+size_t
+skynet_context_memory(struct skynet_context *ctx) {
+	return skynet_memcount_live(ctx->mem);
+}
+
+void
+skynet_memory_report(struct skynet_context *ctx, size_t sz) {
+	ctx->heap = sz;
+}
+
+
+static void
+_overload_event(uint32_t des, uint32_t source, int length) {
+	struct skynet_context * ctx = skynet_handle_grab(des);
+	if (ctx == NULL) {
+		return;
+	}
+	int notify = ctx->overload_notify;
+	skynet_context_release(ctx);
+	if (!notify) {
+		return;
+	}
+	char tmp[16];
+	int n = sprintf(tmp, "%d", length);
+	struct skynet_message smsg;
+	smsg.source = source;
+	smsg.session = 0;
+	smsg.data = skynet_malloc(n+1);
+	memcpy(smsg.data, tmp, n+1);
+	smsg.sz = n | (PTYPE_OVERLOAD << HANDLE_REMOTE_SHIFT);
+	if (skynet_context_push(des, &smsg)) {
+		skynet_free(smsg.data);
+	}
+}
+
+/*
+ 队列越过高水位时，通知队列的所有者和这条消息的发送者。
+ 通知消息的 source 是过载的服务，内容是当时的队列长度。
+ 只发给要求过通知的服务， gate connection 这类 C 模块不认识 PTYPE_OVERLOAD 。
+*/
+static void
+_overload(struct skynet_context *ctx, uint32_t source) {
+	int length = skynet_mq_length(ctx->queue);
+	skynet_error(NULL, "Message queue of %x overload (length = %d)", ctx->handle, length);
+	_overload_event(ctx->handle, ctx->handle, length);
+	if (source && source != ctx->handle && !skynet_harbor_message_isremote(source)) {
+		_overload_event(source, ctx->handle, length);
+	}
+}
+
+// 消息继承当前线程的追踪 id ，带追踪 id 的消息记下入队时间
+static inline void
+_stamp(struct skynet_message *message) {
+	message->trace = skynet_trace_current();
+	message->stamp = message->trace ? skynet_trace_now() : 0;
+}
 
 int
 skynet_context_push(uint32_t handle, struct skynet_message *message) {
@@ -145,7 +363,18 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	if (ctx == NULL) {
 		return -1;
 	}
+	int type = (message->sz >> HANDLE_REMOTE_SHIFT) & ~MESSAGE_TYPE_SHARED;
+	int r = skynet_mq_admit(ctx->queue, type);
+	if (r == MQ_DROP || r == MQ_REJECT) {
+		__sync_add_and_fetch(&ctx->stat.drop, 1);
+		skynet_context_release(ctx);
+		return r == MQ_DROP ? -3 : -2;
+	}
+	_stamp(message);
 	skynet_mq_push(ctx->queue, message);
+	if (r == MQ_OVERLOAD) {
+		_overload(ctx, message->source);
+	}
 	skynet_context_release(ctx);
 
 	return 0;
@@ -163,15 +392,19 @@ skynet_isremote(struct skynet_context * ctx, uint32_t handle, int * harbor) {
 static void
 _send_message(uint32_t des, struct skynet_message *msg) {
 	if (skynet_harbor_message_isremote(des)) {
-			struct remote_message * rmsg = malloc(sizeof(*rmsg));
+			struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
+			size_t sz = msg->sz;
 			rmsg->destination.handle = des;
-			rmsg->message = msg->data;
-			rmsg->sz = msg->sz;
+			rmsg->message = skynet_buffer_unshare(msg->data, &sz);
+			rmsg->sz = sz;
 			skynet_harbor_send(rmsg, msg->source, msg->session);
 	} else {
-		if (skynet_context_push(des, msg)) {
-			free(msg->data);
-			skynet_error(NULL, "Drop message from %x forward to %x (size=%d)", msg->source, des, (int)msg->sz);
+		int r = skynet_context_push(des, msg);
+		if (r) {
+			skynet_buffer_free(msg->data, msg->sz);
+			if (r == -1) {
+				skynet_error(NULL, "Drop message from %x forward to %x (size=%d)", msg->source, des, (int)msg->sz);
+			}
 		}
 	}
 }
@@ -187,10 +420,19 @@ _forwarding(struct skynet_context *ctx, struct skynet_message *msg) {
 	return 0;
 }
 
+// 当前线程正在处理的消息是否是共享 buffer
+static __thread int SHARED = 0;
+
+int
+skynet_message_shared(void) {
+	return SHARED;
+}
+
 static void
 _mc(void *ud, uint32_t source, const void * msg, size_t sz) {
 	struct skynet_context * ctx = ud;
-	int type = sz >> HANDLE_REMOTE_SHIFT;
+	// 组播消息由 multicast 持有和释放，接收方只能读
+	int type = (sz >> HANDLE_REMOTE_SHIFT) & ~MESSAGE_TYPE_SHARED;
 	sz &= HANDLE_MASK;
 	ctx->cb(ctx, ctx->cb_ud, type, 0, source, msg, sz);
 	if (ctx->forward) {
@@ -199,33 +441,61 @@ _mc(void *ud, uint32_t source, const void * msg, size_t sz) {
 		struct skynet_message message;
 		message.source = source;
 		message.session = 0;
-		message.data = malloc(sz);
+		message.data = skynet_malloc(sz);
 		memcpy(message.data, msg, sz);
 		message.sz = sz  | (type << HANDLE_REMOTE_SHIFT);
 		_send_message(des, &message);
 	}
 }
 
+static inline uint64_t
+_clock() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
 static void
 _dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	assert(ctx->init);
 	CHECKCALLING_BEGIN(ctx)
-	int type = msg->sz >> HANDLE_REMOTE_SHIFT;
+	struct skynet_memcount * mem = skynet_memcount_switch(ctx->mem);
+	int type = (msg->sz >> HANDLE_REMOTE_SHIFT) & ~MESSAGE_TYPE_SHARED;
 	size_t sz = msg->sz & HANDLE_MASK;
+	uint64_t start = _clock();
+	skynet_trace_set(msg->trace);
 	if (type == PTYPE_MULTICAST) {
 		skynet_multicast_dispatch((struct skynet_multicast_message *)msg->data, ctx, _mc);
 	} else {
+		SHARED = (msg->sz >> HANDLE_REMOTE_SHIFT) & MESSAGE_TYPE_SHARED ? 1 : 0;
 		int reserve = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+		SHARED = 0;
 		reserve |= _forwarding(ctx, msg);
 		if (!reserve) {
-			free(msg->data);
+			skynet_buffer_free(msg->data, msg->sz);
 		}
 	}
+	uint64_t cost = _clock() - start;
+	ctx->stat.cpu += cost;
+	if (msg->trace) {
+		skynet_trace_record(msg->trace, ctx->handle, msg->source, type, msg->stamp, (uint32_t)(start / 1000), (uint32_t)(cost / 1000));
+	}
+	// 回调里可能用 TRACE 开始了新的追踪，只在这次回调内有效
+	skynet_trace_set(0);
+	ctx->stat.message ++;
+	ctx->stat.bytes_in += sz;
+	skynet_memcount_switch(mem);
 	CHECKCALLING_END(ctx)
 }
 
+/*
+ 处理一个二级消息队列。
+ batch 大于 0 时每轮最多处理 batch 条消息；
+ 否则按队列当前长度处理 length >> weight 条， weight 小于 0 时只处理一条。
+ 处理条数在取出队列时就确定了，处理过程中新到的消息留到下一轮，保证一个繁忙的服务不会饿死其他服务。
+*/
 int
-skynet_context_message_dispatch(void) {
+skynet_context_message_dispatch(struct skynet_monitor *sm, int batch, int weight) {
 	struct message_queue * q = skynet_globalmq_pop();
 	if (q==NULL)
 		return 1;
@@ -241,17 +511,43 @@ skynet_context_message_dispatch(void) {
 		return 0;
 	}
 
-	struct skynet_message msg;
-	if (skynet_mq_pop(q,&msg)) {
-		skynet_context_release(ctx);
-		return 0;
+	int length = skynet_mq_length(q);
+	if (length > ctx->stat.mqlen_max) {
+		ctx->stat.mqlen_max = length;
 	}
 
-	if (ctx->cb == NULL) {
-		free(msg.data);
-		skynet_error(NULL, "Drop message from %x to %x without callback , size = %d",msg.source, handle, (int)msg.sz);
-	} else {
-		_dispatch_message(ctx, &msg);
+	int n = batch;
+	if (n <= 0) {
+		n = 1;
+		if (weight >= 0) {
+			n = skynet_mq_length(q) >> weight;
+			if (n < 1) {
+				n = 1;
+			}
+		}
+	}
+
+	int i;
+	for (i=0;i<n;i++) {
+		struct skynet_message msg;
+		if (skynet_mq_pop(q,&msg)) {
+			skynet_context_release(ctx);
+			return 0;
+		}
+
+		if (ctx->cb == NULL) {
+			skynet_buffer_free(msg.data, msg.sz);
+			skynet_error(NULL, "Drop message from %x to %x without callback , size = %d",msg.source, handle, (int)msg.sz);
+		} else {
+			skynet_monitor_trigger(sm, msg.source, handle);
+			_dispatch_message(ctx, &msg);
+			skynet_monitor_trigger(sm, 0, 0);
+		}
+
+		// 回调里 EXIT 了自己或被别的服务 KILL ，剩下的消息留给 skynet_mq_release 丢弃
+		if (ctx->retired) {
+			break;
+		}
 	}
 
 	assert(q == ctx->queue);
@@ -319,6 +615,58 @@ skynet_queryname(struct skynet_context * context, const char * name) {
 	return 0;
 }
 
+static void
+_format_stat(char * buffer, struct skynet_context * ctx) {
+	struct context_stat * s = &ctx->stat;
+	sprintf(buffer, "%llu %llu %llu %llu %d %llu %llu",
+		(unsigned long long)s->message,
+		(unsigned long long)s->bytes_in,
+		(unsigned long long)s->bytes_out,
+		(unsigned long long)(s->cpu / 1000),
+		s->mqlen_max,
+		(unsigned long long)s->drop,
+		(unsigned long long)s->stall);
+}
+
+static void
+_dump_context(struct skynet_context * ctx, void * ud) {
+	FILE * f = ud;
+	char tmp[128];
+	_format_stat(tmp, ctx);
+	fprintf(f, ":%08x %s\n", ctx->handle, tmp);
+}
+
+/*
+ 快照格式：
+ stat <启动后的秒数>
+ :handle 消息数 收到的字节 发出的字节 回调耗时(微秒) 最大队列长度 丢弃数 卡住次数
+ worker id 忙碌时间(微秒) 空闲时间(微秒)
+*/
+static void
+_dump_stat(FILE * f) {
+	fprintf(f, "stat %u\n", skynet_gettime() / 100);
+	skynet_handle_foreach(_dump_context, f);
+	int i;
+	uint64_t busy, idle;
+	for (i=0; skynet_worker_stat(i, &busy, &idle) == 0; i++) {
+		fprintf(f, "worker %d %llu %llu\n", i, (unsigned long long)busy, (unsigned long long)idle);
+	}
+}
+
+void
+skynet_context_stall(uint32_t handle, uint32_t source, uint64_t elapsed, int signal) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return;
+	}
+	__sync_add_and_fetch(&ctx->stat.stall, 1);
+	skynet_error(NULL, "A message from %x to %x has been running for %d ms, maybe in an endless loop", source, handle, (int)(elapsed / 1000));
+	if (signal) {
+		skynet_module_instance_signal(ctx->mod, ctx->instance, signal);
+	}
+	skynet_context_release(ctx);
+}
+
 const char * 
 skynet_command(struct skynet_context * context, const char * cmd , const char * param) {
 	if (strcmp(cmd,"TIMEOUT") == 0) {
@@ -332,6 +680,26 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 		return context->result;
 	}
 
+	if (strcmp(cmd,"TIMEOUT_MS") == 0) {
+		char * session_ptr = NULL;
+		int ti = strtol(param, &session_ptr, 10);
+		int session = skynet_context_newsession(context);
+		if (session < 0) 
+			return NULL;
+		skynet_timeout_ms(context->handle, ti, session);
+		sprintf(context->result, "%d", session);
+		return context->result;
+	}
+
+	if (strcmp(cmd,"CANCEL") == 0) {
+		int session = strtol(param, NULL, 10);
+		if (skynet_timer_cancel(context->handle, session)) {
+			return NULL;
+		}
+		sprintf(context->result, "%d", session);
+		return context->result;
+	}
+
 	if (strcmp(cmd,"REG") == 0) {
 		if (param == NULL || param[0] == '\0') {
 			sprintf(context->result, ":%x", context->handle);
@@ -340,7 +708,7 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 			return skynet_handle_namehandle(context->handle, param + 1);
 		} else {
 			assert(context->handle!=0);
-			struct remote_name *rname = malloc(sizeof(*rname));
+			struct remote_name *rname = skynet_malloc(sizeof(*rname));
 			_copy_name(rname->name, param);
 			rname->handle = context->handle;
 			skynet_harbor_register(rname);
@@ -363,7 +731,7 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 		if (name[0] == '.') {
 			return skynet_handle_namehandle(handle_id, name + 1);
 		} else {
-			struct remote_name *rname = malloc(sizeof(*rname));
+			struct remote_name *rname = skynet_malloc(sizeof(*rname));
 			_copy_name(rname->name, name);
 			rname->handle = handle_id;
 			skynet_harbor_register(rname);
@@ -377,6 +745,12 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 		return context->result;
 	}
 
+	if (strcmp(cmd,"NOW_US") == 0) {
+		uint64_t ti = skynet_gettime_us();
+		sprintf(context->result,"%llu",(unsigned long long)ti);
+		return context->result;
+	}
+
 	if (strcmp(cmd,"EXIT") == 0) {
 		skynet_handle_retire(context->handle);
 		return NULL;
@@ -397,11 +771,16 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 		return NULL;
 	}
 
+	// LAUNCH [@affinity] mod args ， affinity 的格式同 AFFINITY 命令
 	if (strcmp(cmd,"LAUNCH") == 0) {
 		size_t sz = strlen(param);
 		char tmp[sz+1];
 		strcpy(tmp,param);
 		char * args = tmp;
+		char * affinity = NULL;
+		if (args[0] == '@') {
+			affinity = strsep(&args, " \t\r\n") + 1;
+		}
 		char * mod = strsep(&args, " \t\r\n");
 		args = strsep(&args, "\r\n");
 		struct skynet_context * inst = skynet_context_new(mod,args);
@@ -409,6 +788,15 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 			fprintf(stderr, "Launch %s %s failed\n",mod,args);
 			return NULL;
 		} else {
+			if (affinity) {
+				uint64_t mask;
+				int exclusive;
+				if (_parse_affinity(affinity, &mask, &exclusive)) {
+					skynet_error(context, "Invalid affinity %s for %s", affinity, mod);
+				} else {
+					skynet_mq_affinity(inst->queue, mask, exclusive);
+				}
+			}
 			_id_to_hex(context->result, inst->handle);
 			printf("[:%x] launch %s\n",inst->handle, param);
 			return context->result;
@@ -436,6 +824,229 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 		return NULL;
 	}
 
+	// MEM [:handle] 返回 "模块内存 消息数据 队列中的消息数据" 三个字节数，不带参数时查询自己
+	if (strcmp(cmd,"MEM") == 0) {
+		uint32_t handle = _target_handle(context->handle, &param);
+		struct skynet_context * ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
+			return NULL;
+		}
+		sprintf(context->result, "%zu %zu %zu", ctx->heap, skynet_context_memory(ctx), skynet_mq_bytes(ctx->queue));
+		skynet_context_release(ctx);
+		return context->result;
+	}
+
+	// MQLEN [:handle|.name] 返回队列长度，不带参数时查询自己
+	if (strcmp(cmd,"MQLEN") == 0) {
+		uint32_t handle = _target_handle(context->handle, &param);
+		struct skynet_context * ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
+			return NULL;
+		}
+		sprintf(context->result, "%d", skynet_mq_length(ctx->queue));
+		skynet_context_release(ctx);
+		return context->result;
+	}
+
+	// MQLIMIT n 设置自己队列的高水位， 0 表示不限制
+	if (strcmp(cmd,"MQLIMIT") == 0) {
+		skynet_mq_highwater(context->queue, strtol(param, NULL, 10));
+		context->overload_notify = 1;
+		return NULL;
+	}
+
+	// MQNOTIFY 要求接收过载通知，包括自己的队列和自己发往的队列越过高水位
+	if (strcmp(cmd,"MQNOTIFY") == 0) {
+		context->overload_notify = 1;
+		return NULL;
+	}
+
+	// MQPOLICY type accept|drop|reject 设置超过高水位后对 type 类消息的处理
+	if (strcmp(cmd,"MQPOLICY") == 0) {
+		char * policy = NULL;
+		int type = strtol(param, &policy, 10);
+		while (policy[0] == ' ') {
+			++policy;
+		}
+		if (type == PTYPE_RESPONSE) {
+			skynet_error(context, "Can't set overload policy on response messages");
+			return NULL;
+		}
+		context->overload_notify = 1;
+		if (strcmp(policy, "accept") == 0) {
+			skynet_mq_policy(context->queue, type, MQ_ACCEPT);
+		} else if (strcmp(policy, "drop") == 0) {
+			skynet_mq_policy(context->queue, type, MQ_DROP);
+		} else if (strcmp(policy, "reject") == 0) {
+			skynet_mq_policy(context->queue, type, MQ_REJECT);
+		} else {
+			skynet_error(context, "Invalid overload policy %s", policy);
+		}
+		return NULL;
+	}
+
+	/*
+	 STAT [:handle|.name] 返回服务的
+	 "消息数 收到的字节 发出的字节 回调耗时(微秒) 最大队列长度 丢弃数 卡住次数" ，不带参数时查询自己。
+	 STAT worker id 返回 worker 的 "忙碌时间 空闲时间" ，单位微秒。
+	*/
+	if (strcmp(cmd,"STAT") == 0) {
+		if (param && strncmp(param, "worker", 6) == 0) {
+			uint64_t busy, idle;
+			if (skynet_worker_stat(strtol(param+6, NULL, 10), &busy, &idle)) {
+				return NULL;
+			}
+			sprintf(context->result, "%llu %llu", (unsigned long long)busy, (unsigned long long)idle);
+			return context->result;
+		}
+		uint32_t handle = _target_handle(context->handle, &param);
+		struct skynet_context * ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
+			return NULL;
+		}
+		_format_stat(context->result, ctx);
+		skynet_context_release(ctx);
+		return context->result;
+	}
+
+	// STATDUMP filename 把所有服务和 worker 的统计追加到文件中
+	if (strcmp(cmd,"STATDUMP") == 0) {
+		FILE * f = fopen(param, "a");
+		if (f == NULL) {
+			skynet_error(context, "Can't open stat file %s", param);
+			return NULL;
+		}
+		_dump_stat(f);
+		fclose(f);
+		return NULL;
+	}
+
+	/*
+	 TRACE 为当前消息开始一个新的追踪，返回追踪 id ；
+	 TRACE id 把当前消息归入已有的追踪， 0 表示停止追踪。
+	 只对这次回调中发出的消息有效。
+	*/
+	if (strcmp(cmd,"TRACE") == 0) {
+		uint32_t trace;
+		if (param == NULL || param[0] == '\0') {
+			trace = skynet_trace_new();
+		} else {
+			trace = strtoul(param, NULL, 10);
+		}
+		skynet_trace_set(trace);
+		sprintf(context->result, "%u", trace);
+		return context->result;
+	}
+
+	// PERF start|stop 开始统计所有 worker 的 cache miss ，分别返回打开的计数器个数和期间的总数
+	if (strcmp(cmd,"PERF") == 0) {
+		if (strcmp(param, "start") == 0) {
+			sprintf(context->result, "%d", skynet_perf_start());
+		} else if (strcmp(param, "stop") == 0) {
+			sprintf(context->result, "%llu", (unsigned long long)skynet_perf_stop());
+		} else {
+			return NULL;
+		}
+		return context->result;
+	}
+
+	// HANDOFF n 设置 worker 连续直接处理自己唤醒的服务的次数上限， 0 表示关闭
+	if (strcmp(cmd,"HANDOFF") == 0) {
+		skynet_mq_handoff(strtol(param, NULL, 10));
+		return NULL;
+	}
+
+	// NODE 返回 NUMA 节点数，没有开启 NUMA 分组时为 1
+	if (strcmp(cmd,"NODE") == 0) {
+		sprintf(context->result, "%d", skynet_mq_nodes());
+		return context->result;
+	}
+
+	/*
+	 AFFINITY [:handle|.name] 0,1,2|node:N|exclusive|any
+	 把服务绑定到一组 worker ，或者给它一个独占的 worker ，或者解除绑定。不带地址时作用于自己。
+	 独占 worker 分配之后不会回收，服务退出或者重新绑定后它就一直空闲。
+	*/
+	if (strcmp(cmd,"AFFINITY") == 0) {
+		uint32_t handle = _target_handle(context->handle, &param);
+		if (handle == 0) {
+			return NULL;
+		}
+		struct skynet_context * ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
+			return NULL;
+		}
+		uint64_t mask;
+		int exclusive;
+		if (_parse_affinity(param, &mask, &exclusive)) {
+			skynet_error(context, "Invalid affinity %s", param);
+		} else {
+			skynet_mq_affinity(ctx->queue, mask, exclusive);
+		}
+		skynet_context_release(ctx);
+		return NULL;
+	}
+
+	// PRIORITY [:handle|.name] high|normal|low 设置服务的调度优先级，不带地址时作用于自己
+	if (strcmp(cmd,"PRIORITY") == 0) {
+		uint32_t handle = _target_handle(context->handle, &param);
+		if (handle == 0) {
+			return NULL;
+		}
+		int priority;
+		if (strcmp(param, "high") == 0) {
+			priority = MQ_PRIORITY_HIGH;
+		} else if (strcmp(param, "normal") == 0) {
+			priority = MQ_PRIORITY_NORMAL;
+		} else if (strcmp(param, "low") == 0) {
+			priority = MQ_PRIORITY_LOW;
+		} else {
+			skynet_error(context, "Invalid priority %s", param);
+			return NULL;
+		}
+		struct skynet_context * ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
+			return NULL;
+		}
+		skynet_mq_priority(ctx->queue, priority);
+		skynet_context_release(ctx);
+		return NULL;
+	}
+
+	// TRACEDUMP filename 把追踪记录的时间线和各服务排队延迟的直方图追加到文件中
+	if (strcmp(cmd,"TRACEDUMP") == 0) {
+		FILE * f = fopen(param, "a");
+		if (f == NULL) {
+			skynet_error(context, "Can't open trace file %s", param);
+			return NULL;
+		}
+		skynet_trace_dump(f);
+		fclose(f);
+		return NULL;
+	}
+
+	/*
+	 PROFILE [:handle|.name] start [count] 或 PROFILE [:handle|.name] stop [filename]
+	 开关服务的采样分析器，不带地址时作用于自己。
+	 服务自己的 lua_State 只能在它自己的线程里操作，所以这里只是给它发一条 PTYPE_DEBUG 消息。
+	*/
+	if (strcmp(cmd,"PROFILE") == 0) {
+		uint32_t handle = _target_handle(context->handle, &param);
+		if (handle == 0) {
+			return NULL;
+		}
+		size_t sz = strlen(param);
+		char msg[sz + sizeof("PROFILE ")];
+		sprintf(msg, "PROFILE %s", param);
+		skynet_send(context, 0, handle, PTYPE_DEBUG, 0, msg, strlen(msg));
+		return NULL;
+	}
+
+	if (strcmp(cmd,"PARKED") == 0) {
+		sprintf(context->result,"%d",skynet_mq_parked());
+		return context->result;
+	}
+
 	if (strcmp(cmd,"STARTTIME") == 0) {
 		uint32_t sec = skynet_gettime_fixsec();
 		sprintf(context->result,"%u",sec);
@@ -457,17 +1068,22 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 	return NULL;
 }
 
-void 
+int
 skynet_forward(struct skynet_context * context, uint32_t destination) {
-	assert(context->forward == 0);
+	if (context->forward) {
+		return -1;
+	}
 	context->forward = destination;
+	return 0;
 }
 
 static void
 _filter_args(struct skynet_context * context, int type, int *session, void ** data, size_t * sz) {
 	int dontcopy = type & PTYPE_TAG_DONTCOPY;
 	int allocsession = type & PTYPE_TAG_ALLOCSESSION;
+	int shared = type & PTYPE_TAG_SHARED;
 	type &= 0xff;
+	assert((type & MESSAGE_TYPE_SHARED) == 0);
 
 	if (allocsession) {
 		assert(*session == 0);
@@ -475,10 +1091,10 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 	}
 
 	char * msg;
-	if (dontcopy || *data == NULL) {
+	if (dontcopy || shared || *data == NULL) {
 		msg = *data;
 	} else {
-		msg = malloc(*sz+1);
+		msg = skynet_malloc(*sz+1);
 		memcpy(msg, *data, *sz);
 		msg[*sz] = '\0';
 	}
@@ -486,6 +1102,9 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 
 	assert((*sz & HANDLE_MASK) == *sz);
 	*sz |= type << HANDLE_REMOTE_SHIFT;
+	if (shared) {
+		*sz |= (size_t)MESSAGE_TYPE_SHARED << HANDLE_REMOTE_SHIFT;
+	}
 }
 
 int
@@ -495,14 +1114,15 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 	if (source == 0) {
 		source = context->handle;
 	}
+	context->stat.bytes_out += sz & HANDLE_MASK;
 
 	if (destination == 0) {
 		return session;
 	}
 	if (skynet_harbor_message_isremote(destination)) {
-		struct remote_message * rmsg = malloc(sizeof(*rmsg));
+		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
 		rmsg->destination.handle = destination;
-		rmsg->message = data;
+		rmsg->message = skynet_buffer_unshare(data, &sz);
 		rmsg->sz = sz;
 		skynet_harbor_send(rmsg, source, session);
 	} else {
@@ -512,10 +1132,14 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.data = data;
 		smsg.sz = sz;
 
-		if (skynet_context_push(destination, &smsg)) {
-			free(data);
-			skynet_error(NULL, "Drop message from %x to %x (size=%d)", source, destination, (int)sz);
-			return -1;
+		int r = skynet_context_push(destination, &smsg);
+		if (r) {
+			skynet_buffer_free(data, sz);
+			if (r == -1) {
+				skynet_error(NULL, "Drop message from %x to %x (size=%d)", source, destination, (int)sz);
+			}
+			// 被丢弃的消息对发送者来说和发送成功一样
+			return r == -3 ? session : -1;
 		}
 	}
 	return session;
@@ -530,17 +1154,21 @@ skynet_sendname(struct skynet_context * context, const char * addr , int type, i
 	} else if (addr[0] == '.') {
 		des = skynet_handle_findname(addr + 1);
 		if (des == 0) {
-			free(data);
+			if (type & PTYPE_TAG_SHARED) {
+				skynet_buffer_release(data);
+			} else {
+				skynet_free(data);
+			}
 			skynet_error(context, "Drop message to %s", addr);
 			return session;
 		}
 	} else {
 		_filter_args(context, type, &session, (void **)&data, &sz);
 
-		struct remote_message * rmsg = malloc(sizeof(*rmsg));
+		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
 		_copy_name(rmsg->destination.name, addr);
 		rmsg->destination.handle = 0;
-		rmsg->message = data;
+		rmsg->message = skynet_buffer_unshare(data, &sz);
 		rmsg->sz = sz;
 
 		skynet_harbor_send(rmsg, source, session);
@@ -558,6 +1186,14 @@ skynet_context_handle(struct skynet_context *ctx) {
 	return ctx->handle;
 }
 
+/*
+ ctx 已从 handle 表中摘除，由 skynet_handle_retire 调用
+*/
+void
+skynet_context_retire(struct skynet_context *ctx) {
+	ctx->retired = 1;
+}
+
 /*
  将 handle id 赋值给 ctx
 */
@@ -580,6 +1216,7 @@ skynet_context_send(struct skynet_context * ctx, void * msg, size_t sz, uint32_t
 	smsg.session = session;
 	smsg.data = msg;
 	smsg.sz = sz | type << HANDLE_REMOTE_SHIFT;
+	_stamp(&smsg);
 
 	skynet_mq_push(ctx->queue, &smsg);
 }
@@ -6,17 +6,26 @@
 
 struct skynet_context;
 struct skynet_message;
+struct skynet_monitor;
 
 struct skynet_context * skynet_context_new(const char * name, const char * parm);
 /*
  递增 ctx 的引用计数
 */
 void skynet_context_grab(struct skynet_context *);
+/*
+ 引用计数不为 0 时递增并返回 ctx ，否则返回 NULL 。
+*/
+struct skynet_context * skynet_context_trygrab(struct skynet_context *);
 /*
  递减 ctx 的引用计数，如果为 0 则销毁 ctx 。
 */
 struct skynet_context * skynet_context_release(struct skynet_context *);
 int skynet_context_ref(struct skynet_context *);
+/*
+ ctx 分配的消息数据中尚未释放的字节数
+*/
+size_t skynet_context_memory(struct skynet_context *);
 /*
  获取 ctx 的 handle id
 */
@@ -25,9 +34,26 @@ uint32_t skynet_context_handle(struct skynet_context *);
  将 handle id 赋值给 ctx
 */
 void skynet_context_init(struct skynet_context *, uint32_t handle);
+/*
+ 标记 ctx 已从 handle 表中摘除，正在处理它的 worker 会在当前消息之后停止这一批
+*/
+void skynet_context_retire(struct skynet_context *);
+/*
+ 返回 0 表示成功， -1 服务不存在， -2 被过载策略拒绝， -3 被过载策略丢弃。
+ 失败时 message 的数据由调用者释放。
+*/
 int skynet_context_push(uint32_t handle, struct skynet_message *message);
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 int skynet_context_newsession(struct skynet_context *);
-int skynet_context_message_dispatch(void);	// return 1 when block
+/*
+ batch 大于 0 时每轮最多处理 batch 条消息，否则处理 length >> weight 条（ weight < 0 时为一条）。
+ 处理每条消息前后通知 sm ，供监视线程发现卡住的回调。
+*/
+int skynet_context_message_dispatch(struct skynet_monitor *sm, int batch, int weight);	// return 1 when block
+/*
+ 监视线程发现 handle 处理 source 发来的消息已经 elapsed 微秒时调用。
+ 记录并报告， signal 不为 0 时通知服务模块（ snlua 会打印 lua 调用栈）。
+*/
+void skynet_context_stall(uint32_t handle, uint32_t source, uint64_t elapsed, int signal);
 
 #endif
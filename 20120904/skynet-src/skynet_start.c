@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+
+#include "skynet.h"
 #include "skynet_server.h"
 #include "skynet_imp.h"
 #include "skynet_mq.h"
@@ -6,41 +9,456 @@
 #include "skynet_timer.h"
 #include "skynet_harbor.h"
 #include "skynet_group.h"
+#include "skynet_trace.h"
+#include "skynet_monitor.h"
+#include "skynet_cacheline.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
 
 static void *
 _timer(void *p) {
 	for (;;) {
 		skynet_updatetime();
-		usleep(2500);
+		skynet_timer_wait();
+	}
+	return NULL;
+}
+
+struct worker_parm {
+	int id;
+	int batch;
+	int weight;
+};
+
+// 只记录空闲时间，忙碌时间 = 启动以来的时间 - 空闲时间
+struct worker_stat {
+	uint64_t start;
+	uint64_t idle;
+	uint64_t park;	// 正在休眠时是开始休眠的时间，否则为 0
+	int tid;	// 线程 id ，给性能计数器用， 0 表示线程还没启动
+	int perf;	// 性能计数器的 fd ，没有打开时为 -1
+} CACHE_ALIGNED;	// 每个 worker 休眠时都会写自己的统计
+
+static int PERF_LOCK = 0;	// 同一时间只能有一次性能计数
+static int SIMULATE = 0;
+
+static struct worker_stat * STAT = NULL;
+static int WORKER = 0;
+static int EXCLUSIVE = 0;	// 已经启动的独占 worker 数
+static int BATCH = 1;
+static int CPU_AFFINITY = 0;
+static struct skynet_monitor ** MONITOR = NULL;
+
+#define MAX_NUMA_NODE 64
+
+// 每个 NUMA 节点上的 cpu 列表，从 /sys/devices/system/node 读取
+struct numa_node {
+	int n;
+	int cpu[CPU_SETSIZE];
+};
+
+static int NUMA_NODES = 0;	// 0 表示没有开启 NUMA 分组
+static struct numa_node * NUMA = NULL;
+static int * WORKER_NODE = NULL;
+
+static uint64_t
+_now() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000;
+}
+
+// 到 now 为止的空闲时间，包括正在进行的休眠
+static uint64_t
+_idle(struct worker_stat *s, uint64_t now) {
+	uint64_t park = s->park;
+	uint64_t idle = s->idle;
+	if (park && now > park) {
+		idle += now - park;
+	}
+	return idle;
+}
+
+int
+skynet_worker_stat(int id, uint64_t *busy, uint64_t *idle) {
+	if (id < 0 || id >= WORKER + EXCLUSIVE) {
+		return 1;
+	}
+	struct worker_stat * s = &STAT[id];
+	uint64_t now = _now();
+	uint64_t total = now - s->start;
+	*idle = _idle(s, now);
+	*busy = total > *idle ? total - *idle : 0;
+	return 0;
+}
+
+static int
+_perf_open(int tid) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+/*
+ 给所有已经启动的 worker 线程打开 cache miss 计数器，返回打开的个数。
+ 已经在计数或者内核不允许（见 /proc/sys/kernel/perf_event_paranoid ）时返回 0 。
+*/
+int
+skynet_perf_start(void) {
+	if (__sync_lock_test_and_set(&PERF_LOCK, 1)) {
+		return 0;
+	}
+	int n = 0;
+	int i;
+	for (i=0;i<WORKER + EXCLUSIVE;i++) {
+		struct worker_stat * s = &STAT[i];
+		s->perf = s->tid ? _perf_open(s->tid) : -1;
+		if (s->perf >= 0) {
+			++n;
+		}
+	}
+	if (n == 0) {
+		__sync_lock_release(&PERF_LOCK);
+	}
+	return n;
+}
+
+// 停止计数，返回从 skynet_perf_start 以来所有 worker 的 cache miss 总数
+uint64_t
+skynet_perf_stop(void) {
+	uint64_t total = 0;
+	int i;
+	for (i=0;i<WORKER + EXCLUSIVE;i++) {
+		struct worker_stat * s = &STAT[i];
+		if (s->perf >= 0) {
+			uint64_t count = 0;
+			if (read(s->perf, &count, sizeof(count)) == sizeof(count)) {
+				total += count;
+			}
+			close(s->perf);
+			s->perf = -1;
+		}
+	}
+	__sync_lock_release(&PERF_LOCK);
+	return total;
+}
+
+/*
+ 监视线程：每 threshold / 4 检查一次所有 worker ，
+ 同一条消息处理超过 threshold 的报告一次。
+*/
+struct monitor_parm {
+	uint64_t threshold;	// 微秒
+	int signal;
+};
+
+static void *
+_monitor(void *p) {
+	struct monitor_parm * mp = p;
+	useconds_t interval = mp->threshold / 4;
+	for (;;) {
+		usleep(interval);
+		int n = WORKER + EXCLUSIVE;
+		int i;
+		for (i=0;i<n;i++) {
+			uint32_t source;
+			uint64_t elapsed;
+			uint32_t handle = skynet_monitor_check(MONITOR[i], mp->threshold, &source, &elapsed);
+			if (handle) {
+				skynet_context_stall(handle, source, elapsed, mp->signal);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ 动态调整参与调度的 worker 数，范围是 [min, max] 。
+ 每 SCALE_INTERVAL 采样一次：
+ 就绪的二级消息队列比参与调度的 worker 多，连续 SCALE_GROW 次就增加一个；
+ 参与调度的 worker 空闲时间过半，连续 SCALE_SHRINK 次就减少一个。
+ 增加比减少敏感，两个条件之间留有空档，避免来回抖动。
+*/
+#define SCALE_INTERVAL 100000
+#define SCALE_GROW 3
+#define SCALE_SHRINK 20
+
+struct scale_parm {
+	int min;
+	int max;
+};
+
+static void *
+_scale(void *p) {
+	struct scale_parm * sp = p;
+	int active = sp->min;
+	int grow = 0;
+	int shrink = 0;
+	uint64_t last[sp->max];
+	uint64_t last_time = _now();
+	int i;
+	for (i=0;i<sp->max;i++) {
+		last[i] = _idle(&STAT[i], last_time);
+	}
+	for (;;) {
+		usleep(SCALE_INTERVAL);
+		uint64_t now = _now();
+		uint64_t idle = 0;
+		for (i=0;i<sp->max;i++) {
+			uint64_t t = _idle(&STAT[i], now);
+			if (i < active) {
+				idle += t - last[i];
+			}
+			last[i] = t;
+		}
+		uint64_t total = (now - last_time) * active;
+		last_time = now;
+		int ready = skynet_mq_ready();
+		int n = active;
+		if (ready > active && active < sp->max) {
+			shrink = 0;
+			if (++grow >= SCALE_GROW) {
+				n = active + 1;
+			}
+		} else if (idle * 2 > total && active > sp->min) {
+			grow = 0;
+			if (++shrink >= SCALE_SHRINK) {
+				n = active - 1;
+			}
+		} else {
+			grow = 0;
+			shrink = 0;
+		}
+		if (n != active) {
+			skynet_error(NULL, "Active worker %d -> %d (ready = %d, idle = %d%%)", active, n, ready, (int)(idle * 100 / total));
+			active = n;
+			grow = 0;
+			shrink = 0;
+			skynet_mq_active(active);
+		}
 	}
 	return NULL;
 }
 
 static void *
 _worker(void *p) {
+	struct worker_parm *wp = p;
+	struct worker_stat *stat = &STAT[wp->id];
+	struct skynet_monitor *sm = MONITOR[wp->id];
+	stat->tid = syscall(SYS_gettid);
+	skynet_mq_worker(wp->id);
 	for (;;) {
-		if (skynet_context_message_dispatch()) {
-			usleep(1000);
+		if (skynet_context_message_dispatch(sm, wp->batch, wp->weight)) {
+			uint64_t t = _now();
+			stat->park = t;
+			skynet_mq_park();
+			stat->park = 0;
+			stat->idle += _now() - t;
 		} 
 	}
 	return NULL;
 }
 
+// 解析 "0-3,8-11" 格式的 cpu 列表
 static void
-_start(int thread) {
+_parse_cpulist(const char * list, struct numa_node * node) {
+	node->n = 0;
+	while (*list) {
+		char * end;
+		long from = strtol(list, &end, 10);
+		if (end == list) {
+			break;
+		}
+		long to = from;
+		if (*end == '-') {
+			list = end + 1;
+			to = strtol(list, &end, 10);
+		}
+		long i;
+		for (i=from;i<=to && i<CPU_SETSIZE && node->n < CPU_SETSIZE;i++) {
+			node->cpu[node->n++] = (int)i;
+		}
+		list = end;
+		if (*list == ',') {
+			++list;
+		} else {
+			break;
+		}
+	}
+}
+
+/*
+ 读取 NUMA 拓扑，把 worker 按编号连续地分到各个节点上，独占 worker 轮流分配。
+ 读不到拓扑或只有一个节点时不分组。
+*/
+static void
+_numa_init(int thread) {
+	NUMA = malloc(MAX_NUMA_NODE * sizeof(struct numa_node));
+	int nodes = 0;
+	while (nodes < MAX_NUMA_NODE) {
+		char path[64];
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", nodes);
+		FILE * f = fopen(path, "r");
+		if (f == NULL) {
+			break;
+		}
+		char line[1024];
+		if (fgets(line, sizeof(line), f) == NULL) {
+			line[0] = '\0';
+		}
+		fclose(f);
+		_parse_cpulist(line, &NUMA[nodes]);
+		if (NUMA[nodes].n == 0) {
+			// 没有 cpu 的节点（只有内存）不分配 worker
+			break;
+		}
+		++nodes;
+	}
+	if (nodes <= 1) {
+		free(NUMA);
+		NUMA = NULL;
+		return;
+	}
+	NUMA_NODES = nodes;
+	WORKER_NODE = malloc((thread + MQ_MAX_EXCLUSIVE) * sizeof(int));
+	int i;
+	for (i=0;i<thread;i++) {
+		WORKER_NODE[i] = i * nodes / thread;
+	}
+	for (i=0;i<MQ_MAX_EXCLUSIVE;i++) {
+		WORKER_NODE[thread + i] = i % nodes;
+	}
+}
+
+/*
+ 开启 NUMA 分组时，worker 只在本节点的 cpu 上运行；同时开启 cpu_affinity 时绑定到本节点的某一个 cpu 。
+*/
+static void
+_bind_cpu(pthread_t pid, int id) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (NUMA_NODES) {
+		struct numa_node * node = &NUMA[WORKER_NODE[id]];
+		if (CPU_AFFINITY) {
+			CPU_SET(node->cpu[id % node->n], &set);
+		} else {
+			int i;
+			for (i=0;i<node->n;i++) {
+				CPU_SET(node->cpu[i], &set);
+			}
+		}
+	} else {
+		if (!CPU_AFFINITY) {
+			return;
+		}
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n <= 0) {
+			return;
+		}
+		CPU_SET(id % n, &set);
+	}
+	int err = pthread_setaffinity_np(pid, sizeof(set), &set);
+	if (err) {
+		fprintf(stderr, "Bind worker %d to cpu failed : %d\n", id, err);
+	}
+}
+
+/*
+ 独占 worker 每轮处理整个队列，线程不会退出，也不需要 join 。
+*/
+int
+skynet_worker_exclusive(void) {
+	if (SIMULATE) {
+		// 模拟模式只有一个调度线程，独占就是绑定到它
+		return 0;
+	}
+	int id = skynet_mq_exclusive();
+	if (id < 0) {
+		return -1;
+	}
+	struct worker_parm * wp = malloc(sizeof(*wp));
+	wp->id = id;
+	wp->batch = BATCH;
+	wp->weight = 0;
+	STAT[id].start = _now();
+	STAT[id].idle = 0;
+	STAT[id].park = 0;
+	STAT[id].tid = 0;
+	STAT[id].perf = -1;
+	__sync_add_and_fetch(&EXCLUSIVE, 1);
+
+	pthread_t pid;
+	pthread_create(&pid, NULL, _worker, wp);
+	pthread_detach(pid);
+	_bind_cpu(pid, id);
+	return id;
+}
+
+/*
+ batch 为 0 时按 worker 编号分配权重：前四个 worker 每轮只处理一条消息，
+ 后面的 worker 依次处理整个队列、一半、四分之一……
+*/
+static int
+_weight(int id) {
+	static int weight[] = {
+		-1, -1, -1, -1, 0, 0, 0, 0,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2,
+		3, 3, 3, 3, 3, 3, 3, 3, };
+	if (id < sizeof(weight)/sizeof(weight[0])) {
+		return weight[id];
+	}
+	return 0;
+}
+
+static void
+_start(int thread, int batch, struct monitor_parm *mp, struct scale_parm *sp) {
 	pthread_t pid[thread+1];
+	struct worker_parm wp[thread];
 
 	pthread_create(&pid[0], NULL, _timer, NULL);
+	if (mp->threshold > 0) {
+		pthread_t monitor;
+		pthread_create(&monitor, NULL, _monitor, mp);
+		pthread_detach(monitor);
+	}
+	if (sp->min < sp->max) {
+		pthread_t scale;
+		pthread_create(&scale, NULL, _scale, sp);
+		pthread_detach(scale);
+	}
 
 	int i;
+	uint64_t now = _now();
+	for (i=0;i<thread;i++) {
+		STAT[i].start = now;
+		STAT[i].idle = 0;
+		STAT[i].park = 0;
+		STAT[i].tid = 0;
+		STAT[i].perf = -1;
+	}
 
 	for (i=1;i<thread+1;i++) {
-		pthread_create(&pid[i], NULL, _worker, NULL);
+		wp[i-1].id = i-1;
+		wp[i-1].batch = batch;
+		wp[i-1].weight = _weight(i-1);
+		pthread_create(&pid[i], NULL, _worker, &wp[i-1]);
+		_bind_cpu(pid[i], i-1);
 	}
 
 	for (i=0;i<thread+1;i++) {
@@ -48,6 +466,29 @@ _start(int thread) {
 	}
 }
 
+/*
+ 模拟模式：当前线程作为唯一的 worker 处理所有消息，没有消息时把虚拟时钟拨到下一个定时器。
+ 连定时器也没有时休眠，等其他线程（例如网络）送来消息。
+*/
+static void
+_simulate(int batch) {
+	struct worker_stat *stat = &STAT[0];
+	struct skynet_monitor *sm = MONITOR[0];
+	stat->start = _now();
+	stat->tid = syscall(SYS_gettid);
+	stat->perf = -1;
+	skynet_mq_worker(0);
+	for (;;) {
+		if (skynet_context_message_dispatch(sm, batch, _weight(0)) && skynet_timer_advance()) {
+			uint64_t t = _now();
+			stat->park = t;
+			skynet_mq_park();
+			stat->park = 0;
+			stat->idle += _now() - t;
+		}
+	}
+}
+
 static int
 _start_master(const char * master) {
 	struct skynet_context *ctx = skynet_context_new("master", master);
@@ -58,12 +499,37 @@ _start_master(const char * master) {
 
 void 
 skynet_start(struct skynet_config * config) {
+	if (config->simulate) {
+		SIMULATE = 1;
+		config->thread = 1;
+		config->thread_min = 0;
+		config->numa = 0;
+		config->schedule = "global";
+	}
 	skynet_group_init();
 	skynet_harbor_init(config->harbor);
+	skynet_trace_init(config->harbor);
 	skynet_handle_init(config->harbor);
-	skynet_mq_init(config->mqueue_size);
+	if (config->numa) {
+		_numa_init(config->thread);
+	}
+	skynet_mq_init(config->mqueue_size, config->thread, strcmp(config->schedule, "steal") == 0, config->mqueue_highwater, NUMA_NODES, WORKER_NODE);
+	skynet_mq_handoff(config->handoff);
+	skynet_mq_simulate(config->simulate);
 	skynet_module_init(config->module_path);
-	skynet_timer_init();
+	skynet_timer_init(config->timer_tick, config->simulate);
+
+	// 独占 worker 可能在启动服务时就被分配，所以统计要先准备好
+	WORKER = config->thread;
+	BATCH = config->batch;
+	CPU_AFFINITY = config->cpu_affinity;
+	STAT = skynet_cacheline_alloc((WORKER + MQ_MAX_EXCLUSIVE) * sizeof(struct worker_stat));
+	memset(STAT, 0, (WORKER + MQ_MAX_EXCLUSIVE) * sizeof(struct worker_stat));
+	MONITOR = malloc((WORKER + MQ_MAX_EXCLUSIVE) * sizeof(struct skynet_monitor *));
+	int i;
+	for (i=0;i<WORKER + MQ_MAX_EXCLUSIVE;i++) {
+		MONITOR[i] = skynet_monitor_new();
+	}
 
 	if (config->standalone) {
 		if (_start_master(config->standalone)) {
@@ -85,6 +551,18 @@ skynet_start(struct skynet_config * config) {
 	assert(ctx);
 	ctx = skynet_context_new("snlua", config->start);
 
-	_start(config->thread);
+	struct monitor_parm mp;
+	mp.threshold = (uint64_t)config->stall_threshold * 1000;
+	mp.signal = config->stall_traceback;
+	// thread_min 为 0 或者不小于 thread 时 worker 数固定
+	struct scale_parm sp;
+	sp.max = config->thread;
+	sp.min = config->thread_min > 0 && config->thread_min < config->thread ? config->thread_min : config->thread;
+	skynet_mq_active(sp.min);
+	if (SIMULATE) {
+		_simulate(config->batch);
+	} else {
+		_start(config->thread, config->batch, &mp, &sp);
+	}
 }
 
@@ -4,10 +4,15 @@
 #include "skynet_handle.h"
 #include "skynet.h"
 
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef void (*timer_execute_func)(void *ud,void *arg);
 
@@ -18,6 +23,14 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
+#define DEFAULT_TICK 10	// 默认一个嘀嗒 10 毫秒
+#define NO_EVENT UINT32_MAX
+#define NO_WAKEUP UINT64_MAX
+#define TIMER_SLAB 256	// timer_node 每次批量分配的个数
+#define TIMER_CACHE 64	// 每个线程从公共 freelist 一次取走的 timer_node 个数
+#define DEFAULT_HASH_SIZE 256
+#define MAX_TIMEOUT 0x7fffffff	// 定时器最多的嘀嗒数，嘀嗒为 1 毫秒时大约 24.8 天
+
 struct timer_event {
 	uint32_t handle;
 	int session;
@@ -25,35 +38,70 @@ struct timer_event {
 
 struct timer_node {
 	struct timer_node *next;
-	int expire;
+	struct timer_node *prev;	// 双向链表，取消定时器时可以直接摘除
+	struct timer_node *hash_next;	// 按 (handle, session) 索引的哈希链
+	struct timer_node **hash_prev;
+	uint32_t expire;
+	struct timer_event event;
 };
 
 struct link_list {
-	struct timer_node head;		// 头部， head->next 指向第一个节点
-	struct timer_node *tail;	// 尾部，插入操作发生在尾部
+	struct timer_node head;		// 哨兵， head.next 指向第一个节点， head.prev 指向最后一个节点，插入操作发生在尾部
 };
 
 struct timer {
 	struct link_list near[TIME_NEAR];
-	struct link_list t[4][TIME_LEVEL-1];
+	struct link_list t[4][TIME_LEVEL];
 	int lock;
-	int time;		// skynet 的嘀嗒数
+	uint32_t time;		// skynet 的嘀嗒数，定时器线程处理到的位置，允许回绕
+	uint64_t wakeup;	// timerfd 已经设定的唤醒嘀嗒， NO_WAKEUP 表示没有定时器，和 timerfd 一起由 arm_lock 保护
+	int arm_lock;	// 比较 wakeup 和设定 timerfd 必须一起完成，否则先后两次设定可能乱序
+	int tick;		// 一个嘀嗒的毫秒数，可以是 1 5 10
+	int fd;			// timerfd ，定时器线程阻塞在上面直到下一个需要处理的嘀嗒
+	uint64_t origin;	// 嘀嗒 0 对应的 CLOCK_MONOTONIC 纳秒数
+	struct timer_node *inbound;	// 新加入的定时器，生产者无锁压入，持有 lock 时整体取走放进时间轮
+	int pool_lock;
+	struct timer_node *freelist;	// 回收的 timer_node ，由 pool_lock 保护，批量分配，不归还给系统
+	struct timer_node **hash;	// 未到期定时器按 (handle, session) 的索引，用于取消
+	int hash_size;
+	int hash_count;
 	uint32_t current;
 	uint32_t starttime;
 };
 
 static struct timer * TI = NULL;
 
+static int SIMULATE = 0;	// 模拟模式使用虚拟时钟，只在 skynet_timer_advance 时前进
+static uint64_t VIRTUAL = 0;	// 虚拟时钟，纳秒
+
+static __thread struct timer_node * CACHE = NULL;	// 当前线程私有的空闲 timer_node
+
+static inline void
+link_init(struct link_list *list)
+{
+	list->head.next = &(list->head);
+	list->head.prev = &(list->head);
+}
+
+static inline int
+link_empty(struct link_list *list)
+{
+	return list->head.next == &(list->head);
+}
+
 /*
  重置链表指针。
- 返回原链表的第一个节点。
+ 返回原链表的第一个节点，返回的节点以 next 为 NULL 结尾。
 */
 static inline struct timer_node *
 link_clear(struct link_list *list)
 {
+	if (link_empty(list)) {
+		return NULL;
+	}
 	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	list->head.prev->next = NULL;
+	link_init(list);
 
 	return ret;
 }
@@ -62,11 +110,137 @@ link_clear(struct link_list *list)
  将 node 插入 list 尾端
 */
 static inline void
-link(struct link_list *list,struct timer_node *node)
+link_append(struct link_list *list,struct timer_node *node)
+{
+	node->prev = list->head.prev;
+	node->next = &(list->head);
+	list->head.prev->next = node;
+	list->head.prev = node;
+}
+
+/*
+ 将 node 从所在的链表中摘除
+*/
+static inline void
+link_remove(struct timer_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+static inline uint32_t
+_hash(uint32_t handle, int session)
+{
+	return (handle * 2654435761u) ^ (uint32_t)session;
+}
+
+static void
+hash_link(struct timer_node **slot, struct timer_node *node)
+{
+	node->hash_next = *slot;
+	if (*slot) {
+		(*slot)->hash_prev = &node->hash_next;
+	}
+	node->hash_prev = slot;
+	*slot = node;
+}
+
+static void
+hash_expand(struct timer *T)
+{
+	int size = T->hash_size * 2;
+	struct timer_node **hash = malloc(size * sizeof(struct timer_node *));
+	memset(hash, 0, size * sizeof(struct timer_node *));
+	int i;
+	for (i=0;i<T->hash_size;i++) {
+		struct timer_node *node = T->hash[i];
+		while (node) {
+			struct timer_node *next = node->hash_next;
+			hash_link(&hash[_hash(node->event.handle, node->event.session) & (size-1)], node);
+			node = next;
+		}
+	}
+	free(T->hash);
+	T->hash = hash;
+	T->hash_size = size;
+}
+
+static void
+hash_insert(struct timer *T, struct timer_node *node)
+{
+	if (T->hash_count >= T->hash_size) {
+		hash_expand(T);
+	}
+	++T->hash_count;
+	hash_link(&T->hash[_hash(node->event.handle, node->event.session) & (T->hash_size-1)], node);
+}
+
+static void
+hash_remove(struct timer *T, struct timer_node *node)
+{
+	--T->hash_count;
+	*node->hash_prev = node->hash_next;
+	if (node->hash_next) {
+		node->hash_next->hash_prev = node->hash_prev;
+	}
+}
+
+static struct timer_node *
+hash_find(struct timer *T, uint32_t handle, int session)
+{
+	struct timer_node *node = T->hash[_hash(handle, session) & (T->hash_size-1)];
+	while (node) {
+		if (node->event.handle == handle && node->event.session == session) {
+			return node;
+		}
+		node = node->hash_next;
+	}
+	return NULL;
+}
+
+/*
+ 取一个 timer_node 。先用线程私有的缓存，缓存用完时从公共 freelist 一次取 TIMER_CACHE 个，
+ 公共 freelist 也空了就一次分配 TIMER_SLAB 个。
+*/
+static struct timer_node *
+node_alloc(struct timer *T)
 {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+	if (CACHE == NULL) {
+		while (__sync_lock_test_and_set(&T->pool_lock,1)) {};
+		if (T->freelist == NULL) {
+			struct timer_node *slab = malloc(TIMER_SLAB * sizeof(struct timer_node));
+			int i;
+			for (i=0;i<TIMER_SLAB-1;i++) {
+				slab[i].next = &slab[i+1];
+			}
+			slab[TIMER_SLAB-1].next = NULL;
+			T->freelist = slab;
+		}
+		struct timer_node *last = T->freelist;
+		int i;
+		for (i=1;i<TIMER_CACHE && last->next;i++) {
+			last = last->next;
+		}
+		CACHE = T->freelist;
+		T->freelist = last->next;
+		last->next = NULL;
+		__sync_lock_release(&T->pool_lock);
+	}
+	struct timer_node *node = CACHE;
+	CACHE = node->next;
+	return node;
+}
+
+/*
+ 把以 next 串起来的 head 到 tail 归还到公共 freelist
+*/
+static void
+node_release(struct timer *T, struct timer_node *head, struct timer_node *tail)
+{
+	while (__sync_lock_test_and_set(&T->pool_lock,1)) {};
+	tail->next = T->freelist;
+	T->freelist = head;
+	__sync_lock_release(&T->pool_lock);
 }
 
 /*
@@ -75,18 +249,19 @@ link(struct link_list *list,struct timer_node *node)
 static void
 add_node(struct timer *T,struct timer_node *node)
 {
-	int time=node->expire;
-	int current_time=T->time;
+	uint32_t time=node->expire;
+	uint32_t current_time=T->time;
 	
 	/*
 	 (0000 0011 | 0000 1111) == 0000 1111
 	 (0001 0011 | 0000 1111) == 0001 1111 != 0000 1111
 
 	 表示 time 和 current_time 两个值只在低 TIME_NEAR_MASK 位中
-	 也就是满足条件设立的精度，也就是 2.56 秒内
+	 也就是满足条件设立的精度，也就是 256 个嘀嗒内（嘀嗒为 10 毫秒时是 2.56 秒）。
+	 下面各级的时间跨度同样随嘀嗒长度缩放。
 	*/
 	if ((time|TIME_NEAR_MASK)==(current_time|TIME_NEAR_MASK)) {
-		link(&T->near[time&TIME_NEAR_MASK],node);
+		link_append(&T->near[time&TIME_NEAR_MASK],node);
 	}
 	else {
 		/*
@@ -99,7 +274,7 @@ add_node(struct timer *T,struct timer_node *node)
 		 1111 1111 1111 1111 1111 1111 1111 1111		-- 2 ^ 32 ，4294967296秒，大概 497 天
 		*/
 		int i;
-		int mask=TIME_NEAR << TIME_LEVEL_SHIFT;
+		uint32_t mask=TIME_NEAR << TIME_LEVEL_SHIFT;
 		for (i=0;i<3;i++) {
 			if ((time|(mask-1))==(current_time|(mask-1))) {
 				break;
@@ -110,69 +285,214 @@ add_node(struct timer *T,struct timer_node *node)
 		 二维数组 t 的第一个下标表示的是等级，例如 0 表示容纳的时间是[0, 255]，而 1 表示容纳的时间是[256, 16383]，
 		 越往后靠，权重越大。上面的循环就是为了找到 time 所属的等级，也就是 i 。
 		 第二个下标表示的是位置，也就是说找到组织之后，需要找到自己的位置。
-		 time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT) 得到了一个值 X ，满足 1 <= X <= TIME_LEVEL_MASK ，因为 struct link_list t[4][TIME_LEVEL-1] ，
+		 time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT) 得到了一个值 X ，除了最高一级在嘀嗒数回绕时为 0 之外，满足 1 <= X <= TIME_LEVEL_MASK ，
 		 X 也就是 time 应该进入的链表。
 		 而后面之所以要与上 TIME_LEVEL_MASK 是因为如果传入的 time 非常大，例如是一万年，那么右移之后的值还是大于我们预设的最大值，
 		 所以做了一个裁剪。
 		*/
-		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)-1],node);	
+		link_append(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+	}
+}
+
+static uint64_t
+_monotonic(void) {
+	if (SIMULATE) {
+		return VIRTUAL;
 	}
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
 }
 
 /*
- 添加一个定时器。
- 定时器到时间的时候，当定时时间到的时候，取数据要记得 timer_node + arg
- 根据 timer_execute 中 struct timer_event * event = (struct timer_event *)(current+1); ，
- arg 应该是 timer_event 。
+ 从 timer 创建到现在实际经过的嘀嗒数。定时器线程休眠时 T->time 会落后于它。
+*/
+static uint64_t
+_elapsed(struct timer *T) {
+	return (_monotonic() - T->origin) / ((uint64_t)T->tick * 1000000);
+}
+
+/*
+ 让 timerfd 在嘀嗒 tick 开始的时刻唤醒定时器线程， NO_WAKEUP 表示取消。
 */
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time)
-{
-	struct timer_node *node = (struct timer_node *)malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+_settime(struct timer *T, uint64_t tick) {
+	if (SIMULATE) {
+		return;
+	}
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (tick != NO_WAKEUP) {
+		uint64_t ns = T->origin + tick * T->tick * 1000000;
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+			its.it_value.tv_nsec = 1;
+		}
+	}
+	timerfd_settime(T->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-	while (__sync_lock_test_and_set(&T->lock,1)) {};
+/*
+ 返回距离下一个需要定时器线程处理的嘀嗒还有多少个嘀嗒：最近的非空 near 槽，
+ 或者 t 中还有节点时下一次需要重新分配的位置。都没有则返回 NO_EVENT 。
+ 实际时间到达这个嘀嗒的下一个嘀嗒时才需要唤醒。
+*/
+static uint32_t
+_next_event(struct timer *T) {
+	int i,j;
+	int idx = T->time & TIME_NEAR_MASK;
+	for (i=idx;i<TIME_NEAR;i++) {
+		if (!link_empty(&T->near[i])) {
+			return i - idx;
+		}
+	}
+	for (i=0;i<4;i++) {
+		for (j=0;j<TIME_LEVEL;j++) {
+			if (!link_empty(&T->t[i][j])) {
+				return TIME_NEAR - idx;
+			}
+		}
+	}
+	return NO_EVENT;
+}
 
-		node->expire=time+T->time;
-		add_node(T,node);
+/*
+ 添加一个定时器。
+ 定时器到时间的时候，向 event->handle 发送 session 为 event->session 的 PTYPE_RESPONSE 消息。
+ 不获取 T->lock ：节点压入 inbound 后由定时器线程放进时间轮，所以不会等待到期处理。
+*/
+static void
+timer_add(struct timer *T,struct timer_event *event,uint32_t time)
+{
+	struct timer_node *node = node_alloc(T);
+	node->event = *event;
+
+	// 按实际时间计算到期嘀嗒，定时器线程可能还在休眠， T->time 并不是当前时间
+	uint64_t now = _elapsed(T);
+	node->expire=(uint32_t)(now+time);
+
+	struct timer_node *head;
+	do {
+		head = T->inbound;
+		node->next = head;
+	} while (!__sync_bool_compare_and_swap(&T->inbound, head, node));
+
+	// 嘀嗒 expire 的定时器在实际时间到达 expire+1 时处理，比已设定的唤醒时间早就提前唤醒
+	uint64_t wakeup = now + time + 1;
+	if (wakeup < T->wakeup) {
+		while (__sync_lock_test_and_set(&T->arm_lock,1)) {};
+		if (wakeup < T->wakeup) {
+			T->wakeup = wakeup;
+			_settime(T, wakeup);
+		}
+		__sync_lock_release(&T->arm_lock);
+	}
+}
 
-	__sync_lock_release(&T->lock);
+/*
+ 把 inbound 中的节点按加入顺序放进时间轮。调用者需持有 T->lock
+*/
+static void
+timer_drain(struct timer *T)
+{
+	struct timer_node *current = __sync_lock_test_and_set(&T->inbound, NULL);
+	struct timer_node *list = NULL;
+	while (current) {
+		struct timer_node *next = current->next;
+		current->next = list;
+		list = current;
+		current = next;
+	}
+	while (list) {
+		struct timer_node *next = list->next;
+		// 定时器线程已经越过了到期嘀嗒，就放到当前嘀嗒尽快处理
+		if ((int32_t)(list->expire - T->time) < 0) {
+			list->expire = T->time;
+		}
+		hash_insert(T, list);
+		add_node(T, list);
+		list = next;
+	}
 }
 
 /*
- 定时器更新函数
+ 把当前嘀嗒对应 near 槽中的所有定时器移到 expired ，调用者需持有 T->lock
 */
 static void 
-timer_execute(struct timer *T)
+timer_execute(struct timer *T, struct link_list *expired)
 {
-	while (__sync_lock_test_and_set(&T->lock,1)) {};
 	int idx=T->time & TIME_NEAR_MASK;
-	struct timer_node *current;
-	int mask,i,time;
-	
-	while (T->near[idx].head.next) {
-		current=link_clear(&T->near[idx]);
-		
-		do {
-			struct timer_event * event = (struct timer_event *)(current+1);
-			struct skynet_message message;
-			message.source = 0;
-			message.session = event->session;
-			message.data = NULL;
-			message.sz = PTYPE_RESPONSE << HANDLE_REMOTE_SHIFT;
-
-			skynet_context_push(event->handle, &message);
-			
-			struct timer_node * temp = current;
-			current=current->next;
-			free(temp);	
-		} while (current);
+	struct timer_node *current=link_clear(&T->near[idx]);
+
+	while (current) {
+		struct timer_node * temp = current;
+		current=current->next;
+		hash_remove(T, temp);
+		link_append(expired, temp);
+	}
+}
+
+/*
+ 向到期定时器的服务发送消息并回收节点，不持有 T->lock
+*/
+static void
+timer_dispatch(struct timer *T, struct timer_node *current)
+{
+	struct timer_node *head = current;
+	struct timer_node *tail = NULL;
+	while (current) {
+		struct timer_event * event = &current->event;
+		struct skynet_message message;
+		message.source = 0;
+		message.session = event->session;
+		message.data = NULL;
+		message.sz = PTYPE_RESPONSE << HANDLE_REMOTE_SHIFT;
+
+		skynet_context_push(event->handle, &message);
+
+		tail = current;
+		current=current->next;
+	}
+	if (head) {
+		node_release(T, head, tail);
+	}
+}
+
+/*
+ 把 T 中第 level 级第 idx 个链表的节点重新分配
+*/
+static void
+move_list(struct timer *T, int level, int idx)
+{
+	struct timer_node *current=link_clear(&T->t[level][idx]);
+	while (current) {
+		struct timer_node *temp=current->next;
+		add_node(T,current);
+		current=temp;
+	}
+}
+
+/*
+ 把 T->time 向前推进 step 个嘀嗒，并在跨过边界时把高层链表中的节点重新分配。
+ 推进的范围内不能有非空的 near 槽，也不能跨过 t 中还有节点时的分配边界，
+ 由 _next_event 保证。调用者需持有 T->lock
+*/
+static void
+timer_shift(struct timer *T, uint32_t step)
+{
+	int mask,i,idx;
+	uint32_t time;
+
+	uint32_t ct = T->time += step;
+	if (ct == 0) {
+		// 嘀嗒数回绕，最高一级的 0 号链表到期
+		move_list(T, 3, 0);
+		return;
 	}
-	
-	++T->time;
 	
 	mask = TIME_NEAR;
-	time = T->time >> TIME_NEAR_SHIFT;
+	time = ct >> TIME_NEAR_SHIFT;
 	i=0;
 	
 	/*
@@ -188,23 +508,16 @@ timer_execute(struct timer *T)
 	 	但是 idx 前面的索引必须动，因为 idx 前面的索引肯定是新加的，如果不是新加的那么早就执行了。既然是新加的，就
 	 	必须不停的更新。
 	*/
-	while ((T->time & (mask-1))==0) {
+	while ((ct & (mask-1))==0) {
 		idx=time & TIME_LEVEL_MASK;
 		if (idx!=0) {
-			--idx;
-			current=link_clear(&T->t[i][idx]);
-			while (current) {
-				struct timer_node *temp=current->next;
-				add_node(T,current);
-				current=temp;
-			}
+			move_list(T, i, idx);
 			break;				
 		}
 		mask <<= TIME_LEVEL_SHIFT;
 		time >>= TIME_LEVEL_SHIFT;
 		++i;
 	}	
-	__sync_lock_release(&T->lock);
 }
 
 /*
@@ -219,26 +532,27 @@ timer_create_timer()
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&r->near[i]);
 	}
 
 	for (i=0;i<4;i++) {
-		for (j=0;j<TIME_LEVEL-1;j++) {
-			link_clear(&r->t[i][j]);
+		for (j=0;j<TIME_LEVEL;j++) {
+			link_init(&r->t[i][j]);
 		}
 	}
 
+	r->hash_size = DEFAULT_HASH_SIZE;
+	r->hash = malloc(r->hash_size * sizeof(struct timer_node *));
+	memset(r->hash, 0, r->hash_size * sizeof(struct timer_node *));
+
 	r->lock = 0;
 	r->current = 0;
 
 	return r;
 }
 
-/*
- 添加系统定时器消息，启动一个自主逻辑。
-*/
-int
-skynet_timeout(uint32_t handle, int time, int session) {
+static int
+_timeout(uint32_t handle, uint32_t time, int session) {
 	if (time == 0) {
 		struct skynet_message message;
 		message.source = 0;
@@ -253,39 +567,158 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, time);
 	}
 
 	return session;
 }
 
 /*
- 计算系统启动到现在的嘀嗒数，单位是 10 豪秒
+ 取消 handle 的 session 对应的定时器。定时器已经到期（或者 TIMEOUT 0 直接发出）时返回 -1 。
+*/
+int
+skynet_timer_cancel(uint32_t handle, int session) {
+	struct timer *T = TI;
+	while (__sync_lock_test_and_set(&T->lock,1)) {};
+
+	timer_drain(T);
+	struct timer_node *node = hash_find(T, handle, session);
+	if (node) {
+		link_remove(node);
+		hash_remove(T, node);
+	}
+
+	__sync_lock_release(&T->lock);
+
+	if (node) {
+		node_release(T, node, node);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ 换算出的嘀嗒数超过 MAX_TIMEOUT 时截断并报告，负数当作 0
+*/
+static uint32_t
+_clamp(uint32_t handle, int64_t ticks) {
+	if (ticks < 0)
+		return 0;
+	if (ticks > MAX_TIMEOUT) {
+		skynet_error(NULL, "Timeout of %x is too long (%lld ticks), clamp to %d ticks", handle, (long long)ticks, MAX_TIMEOUT);
+		return MAX_TIMEOUT;
+	}
+	return (uint32_t)ticks;
+}
+
+/*
+ 添加系统定时器消息，启动一个自主逻辑。 time 的单位是 10 毫秒，与嘀嗒长度无关。
+*/
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	return _timeout(handle, _clamp(handle, (int64_t)time * 10 / TI->tick), session);
+}
+
+/*
+ 同 skynet_timeout ， time 的单位是毫秒，向上取整到嘀嗒。
+*/
+int
+skynet_timeout_ms(uint32_t handle, int time, int session) {
+	return _timeout(handle, _clamp(handle, ((int64_t)time + TI->tick - 1) / TI->tick), session);
+}
+
+/*
+ 计算系统启动到现在的嘀嗒数，单位是 10 豪秒。模拟模式下是虚拟时钟启动以来的时间
 */
 static uint32_t
 _gettime(void) {
-	struct timespec ti;
-	clock_gettime(CLOCK_MONOTONIC, &ti);	// 返回的是系统启动到现在的秒数和纳秒数
-	uint32_t t = (uint32_t)(ti.tv_sec & 0xffffff) * 100;	// 秒数乘以 1000 等于毫秒数，那么乘以 100 就是10毫秒数
-	t += ti.tv_nsec / 10000000;		// 纳秒 / (1000 000 000 * 100) ，也就是先转成秒数再乘以 100 ，就是10毫秒数
+	uint64_t ns = _monotonic();	// 系统启动到现在的纳秒数
+	uint32_t t = (uint32_t)((ns / 1000000000) & 0xffffff) * 100;	// 秒数乘以 1000 等于毫秒数，那么乘以 100 就是10毫秒数
+	t += (ns % 1000000000) / 10000000;		// 纳秒 / (1000 000 000 * 100) ，也就是先转成秒数再乘以 100 ，就是10毫秒数
 
 	return t;
 }
 
 /*
- 定时器更新，10毫秒为一个嘀嗒
+ 定时器更新。
+ 一次性追上实际时间：只在有定时器到期或需要重新分配的嘀嗒停下，中间的空嘀嗒直接跳过。
+ 处理完后把 timerfd 设到下一个需要处理的嘀嗒。到期消息在释放 T->lock 之后才发送。
 */
 void
 skynet_updatetime(void) {
-	uint32_t ct = _gettime();
-	if (ct > TI->current) {
-		int diff = ct-TI->current;
-		TI->current = ct;
-		int i;
-		for (i=0;i<diff;i++) {
-			timer_execute(TI);
+	struct timer *T = TI;
+	struct link_list expired;
+	link_init(&expired);
+
+	while (__sync_lock_test_and_set(&T->lock,1)) {};
+
+	uint64_t target = _elapsed(T);
+	uint32_t next;
+	timer_drain(T);
+	while (T->time != (uint32_t)target) {
+		timer_execute(T, &expired);
+		next = _next_event(T);
+		if (next == 0) {
+			// 当前槽已经处理完，下一个事件至少在下一个嘀嗒
+			next = 1;
+		}
+		uint32_t remain = (uint32_t)target - T->time;
+		if (next > remain) {
+			next = remain;
+		}
+		timer_shift(T, next);
+	}
+	TI->current = _gettime();
+	for (;;) {
+		next = _next_event(T);
+		uint64_t wakeup = next == NO_EVENT ? NO_WAKEUP : target + next + 1;
+		while (__sync_lock_test_and_set(&T->arm_lock,1)) {};
+		T->wakeup = wakeup;
+		_settime(T, wakeup);
+		__sync_lock_release(&T->arm_lock);
+		// 和 timer_add 先压入 inbound 再读 wakeup 的顺序相对：要么这里看到新节点，要么对方看到新的 wakeup
+		__sync_synchronize();
+		if (T->inbound == NULL) {
+			break;
 		}
+		timer_drain(T);
 	}
+
+	__sync_lock_release(&T->lock);
+
+	timer_dispatch(T, link_clear(&expired));
+}
+
+/*
+ 阻塞定时器线程直到 timerfd 到期
+*/
+void
+skynet_timer_wait(void) {
+	uint64_t expirations;
+	for (;;) {
+		if (read(TI->fd, &expirations, sizeof(expirations)) >= 0 || errno != EINTR) {
+			return;
+		}
+	}
+}
+
+/*
+ 模拟模式下调度线程没有消息可处理时调用：把虚拟时钟直接拨到下一个需要处理的嘀嗒，
+ 处理到期的定时器。没有定时器时返回 1 。
+*/
+int
+skynet_timer_advance(void) {
+	struct timer *T = TI;
+	uint64_t wakeup = T->wakeup;
+	if (wakeup == NO_WAKEUP) {
+		return 1;
+	}
+	uint64_t ns = T->origin + wakeup * T->tick * 1000000;
+	if (ns > VIRTUAL) {
+		VIRTUAL = ns;
+	}
+	skynet_updatetime();
+	return 0;
 }
 
 uint32_t
@@ -298,7 +731,15 @@ skynet_gettime_fixsec(void) {
 */
 uint32_t 
 skynet_gettime(void) {
-	return TI->current;
+	return _gettime();
+}
+
+/*
+ 定时器启动到现在的微秒数，和定时器用的是同一个时钟
+*/
+uint64_t
+skynet_gettime_us(void) {
+	return (_monotonic() - TI->origin) / 1000;
 }
 
 /*
@@ -309,9 +750,21 @@ skynet_gettime(void) {
  而 CLOCK_REALTIME 是可以被人为改变的。 CLOCK_MONOTONIC 却不能。
 */
 void 
-skynet_timer_init(void) {
+skynet_timer_init(int tick, int simulate) {
+	if (tick != 1 && tick != 5 && tick != 10) {
+		fprintf(stderr, "Invalid timer tick %d ms, use %d ms\n", tick, DEFAULT_TICK);
+		tick = DEFAULT_TICK;
+	}
+	SIMULATE = simulate;
 	TI = timer_create_timer();
+	TI->tick = tick;
 	TI->current = _gettime();
+	TI->origin = _monotonic();
+	TI->wakeup = NO_WAKEUP;
+	if (!simulate) {
+		TI->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		assert(TI->fd >= 0);
+	}
 
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
@@ -4,19 +4,45 @@
 #include <stdint.h>
 
 /*
- 添加系统定时器消息，启动一个自主逻辑。
+ 添加系统定时器消息，启动一个自主逻辑。 time 的单位是 10 毫秒。
+ 最长 0x7fffffff 个嘀嗒，嘀嗒为 1 毫秒时大约 24.8 天，更长的会被截断。
 */
 int skynet_timeout(uint32_t handle, int time, int session);
 /*
- 定时器更新，10毫秒为一个嘀嗒
+ 同 skynet_timeout ， time 的单位是毫秒。
+*/
+int skynet_timeout_ms(uint32_t handle, int time, int session);
+/*
+ 取消 handle 的 session 对应的定时器，成功返回 0 ，定时器已经到期返回 -1
+*/
+int skynet_timer_cancel(uint32_t handle, int session);
+/*
+ 定时器更新，嘀嗒长度由 skynet_timer_init 决定
 */
 void skynet_updatetime(void);
+/*
+ 定时器线程休眠，直到下一个定时器到期或有更早的定时器加入
+*/
+void skynet_timer_wait(void);
 /*
  系统开机到现在的嘀嗒数，单位是 10 毫秒
 */
 uint32_t skynet_gettime(void);
+/*
+ 定时器启动到现在的微秒数，模拟模式下是虚拟时钟
+*/
+uint64_t skynet_gettime_us(void);
 uint32_t skynet_gettime_fixsec(void);
 
-void skynet_timer_init(void);
+/*
+ 模拟模式下没有消息可处理时把虚拟时钟拨到下一个定时器并处理它，没有定时器时返回 1
+*/
+int skynet_timer_advance(void);
+
+/*
+ tick 为一个嘀嗒的毫秒数，可以是 1 5 10
+ simulate 不为 0 时使用从 0 开始的虚拟时钟，不启动定时器线程，由 skynet_timer_advance 推进
+*/
+void skynet_timer_init(int tick, int simulate);
 
 #endif
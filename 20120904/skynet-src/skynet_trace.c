@@ -0,0 +1,228 @@
+#include "skynet.h"
+#include "skynet_trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_RING 4096
+#define HISTOGRAM_SIZE 32
+
+struct trace_event {
+	uint32_t trace;
+	uint32_t handle;
+	uint32_t source;
+	int type;
+	uint32_t enqueue;
+	uint32_t dequeue;
+	uint32_t cost;
+};
+
+// 每个线程一个，只有所属线程写入，挂在全局链表上，永不释放
+struct trace_ring {
+	struct trace_ring * next;
+	unsigned head;
+	struct trace_event e[TRACE_RING];
+};
+
+struct trace {
+	uint32_t harbor;
+	uint32_t id;
+	struct trace_ring * ring;
+};
+
+static struct trace T;
+static __thread struct trace_ring * R = NULL;
+static __thread uint32_t CURRENT = 0;
+
+void
+skynet_trace_init(int harbor) {
+	T.harbor = (uint32_t)harbor << 24;
+}
+
+// 高 8 位是 harbor id ，不同节点产生的追踪 id 不会重复
+uint32_t
+skynet_trace_new(void) {
+	for (;;) {
+		uint32_t id = __sync_add_and_fetch(&T.id, 1) & 0xffffff;
+		if (id) {
+			return T.harbor | id;
+		}
+	}
+}
+
+uint32_t
+skynet_trace_current(void) {
+	return CURRENT;
+}
+
+void
+skynet_trace_set(uint32_t trace) {
+	CURRENT = trace;
+}
+
+uint32_t
+skynet_trace_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint32_t)((uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000);
+}
+
+static struct trace_ring *
+_ring() {
+	struct trace_ring * r = malloc(sizeof(*r));
+	r->head = 0;
+	for (;;) {
+		struct trace_ring * head = T.ring;
+		r->next = head;
+		if (__sync_bool_compare_and_swap(&T.ring, head, r))
+			break;
+	}
+	R = r;
+	return r;
+}
+
+void
+skynet_trace_record(uint32_t trace, uint32_t handle, uint32_t source, int type, uint32_t enqueue, uint32_t dequeue, uint32_t cost) {
+	struct trace_ring * r = R;
+	if (r == NULL) {
+		r = _ring();
+	}
+	struct trace_event * e = &r->e[r->head % TRACE_RING];
+	e->trace = trace;
+	e->handle = handle;
+	e->source = source;
+	e->type = type;
+	e->enqueue = enqueue;
+	e->dequeue = dequeue;
+	e->cost = cost;
+	// 记录写完之后 head 才前进，与 _collect 中的读取配对
+	__sync_synchronize();
+	r->head++;
+}
+
+/*
+ 复制一个线程的记录。读的同时写者可能在覆盖最老的记录，
+ 所以复制完成后重新读一次 head ，丢掉可能已经被覆盖的部分。
+*/
+static int
+_collect(struct trace_ring *r, struct trace_event *out) {
+	unsigned head = r->head;
+	__sync_synchronize();
+	unsigned tail = head > TRACE_RING ? head - TRACE_RING : 0;
+	unsigned i;
+	for (i=tail;i<head;i++) {
+		out[i-tail] = r->e[i % TRACE_RING];
+	}
+	__sync_synchronize();
+	unsigned now = r->head;
+	unsigned valid = now > TRACE_RING ? now - TRACE_RING : 0;
+	if (valid <= tail) {
+		return head - tail;
+	}
+	if (valid >= head) {
+		return 0;
+	}
+	memmove(out, out + (valid - tail), (head - valid) * sizeof(*out));
+	return head - valid;
+}
+
+static int
+_compare_trace(const void *a, const void *b) {
+	const struct trace_event * ea = a;
+	const struct trace_event * eb = b;
+	if (ea->trace != eb->trace) {
+		return ea->trace < eb->trace ? -1 : 1;
+	}
+	int32_t diff = (int32_t)(ea->enqueue - eb->enqueue);
+	return diff < 0 ? -1 : (diff > 0);
+}
+
+static int
+_compare_handle(const void *a, const void *b) {
+	const struct trace_event * ea = a;
+	const struct trace_event * eb = b;
+	if (ea->handle != eb->handle) {
+		return ea->handle < eb->handle ? -1 : 1;
+	}
+	uint32_t da = ea->dequeue - ea->enqueue;
+	uint32_t db = eb->dequeue - eb->enqueue;
+	return da < db ? -1 : (da > db);
+}
+
+static int
+_bucket(uint32_t delay) {
+	int n = 0;
+	while (delay > 1 && n < HISTOGRAM_SIZE-1) {
+		delay >>= 1;
+		++n;
+	}
+	return n;
+}
+
+static void
+_dump_timeline(FILE *f, struct trace_event *e, int n) {
+	uint32_t start = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		if (i == 0 || e[i].trace != e[i-1].trace) {
+			fprintf(f, "trace %08x\n", e[i].trace);
+			start = e[i].enqueue;
+		}
+		fprintf(f, "\t+%u :%08x -> :%08x type %d queue %u callback %u\n",
+			e[i].enqueue - start, e[i].source, e[i].handle, e[i].type,
+			e[i].dequeue - e[i].enqueue, e[i].cost);
+	}
+}
+
+// e 已经按服务和排队延迟排好序，每个服务的百分位数可以直接取
+static void
+_dump_histogram(FILE *f, struct trace_event *e, int n) {
+	int i = 0;
+	while (i < n) {
+		int histogram[HISTOGRAM_SIZE];
+		memset(histogram, 0, sizeof(histogram));
+		uint32_t handle = e[i].handle;
+		struct trace_event * s = &e[i];
+		int count = 0;
+		for (;i<n && e[i].handle == handle;i++) {
+			++histogram[_bucket(e[i].dequeue - e[i].enqueue)];
+			++count;
+		}
+		fprintf(f, "queue :%08x samples %d p50 %u p99 %u max %u\n", handle, count,
+			s[count / 2].dequeue - s[count / 2].enqueue,
+			s[count * 99 / 100].dequeue - s[count * 99 / 100].enqueue,
+			s[count - 1].dequeue - s[count - 1].enqueue);
+		int j;
+		for (j=0;j<HISTOGRAM_SIZE;j++) {
+			if (histogram[j]) {
+				fprintf(f, "\t< %u %d\n", 2u << j, histogram[j]);
+			}
+		}
+	}
+}
+
+void
+skynet_trace_dump(FILE *f) {
+	int rings = 0;
+	struct trace_ring * r;
+	for (r = T.ring; r; r = r->next) {
+		++rings;
+	}
+	if (rings == 0) {
+		return;
+	}
+	struct trace_event * e = malloc(rings * TRACE_RING * sizeof(*e));
+	int n = 0;
+	for (r = T.ring; r; r = r->next) {
+		n += _collect(r, e + n);
+	}
+
+	qsort(e, n, sizeof(*e), _compare_trace);
+	// 时间线中的时间是相对整条追踪第一次入队的微秒数
+	_dump_timeline(f, e, n);
+	qsort(e, n, sizeof(*e), _compare_handle);
+	_dump_histogram(f, e, n);
+
+	free(e);
+}
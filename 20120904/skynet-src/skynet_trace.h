@@ -0,0 +1,23 @@
+#ifndef SKYNET_TRACE_H
+#define SKYNET_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ 消息追踪。
+ 带追踪 id 的消息在入队时记下时间，出队处理时把 入队时间 出队时间 回调耗时
+ 写入当前线程的环形缓冲区。回调中发出的消息继承同一个追踪 id ，经过 harbor 时也会带上。
+ 时间单位是微秒，只保留低 32 位，只用来求差。
+*/
+
+void skynet_trace_init(int harbor);
+uint32_t skynet_trace_new(void);
+uint32_t skynet_trace_now(void);
+void skynet_trace_record(uint32_t trace, uint32_t handle, uint32_t source, int type, uint32_t enqueue, uint32_t dequeue, uint32_t cost);
+/*
+ 把所有线程缓冲区中的记录按追踪 id 整理成时间线，并输出每个服务排队延迟的直方图和百分位数。
+*/
+void skynet_trace_dump(FILE *f);
+
+#endif